@@ -1,35 +1,122 @@
 from collections import namedtuple
 from itertools import chain
 from bisect import bisect_left
+import argparse
 
 SizeClass = namedtuple("SizeClass", "max_size slab_offset slab_count")
 
 max_slab_count = 128
-slab_header_bytes = 64
+slab_header_bytes = 336 # `offsetof(ebi_slab, data)` including the side arrays
 target_slab_bytes = 16*1024
 
-size_classes = []
-
-ranges = chain(
-    range(  16,   128,    16),
-    range( 128,   256,    32),
-    range( 256,   512,    64),
-    range( 512,  2048,   256),
-    [2048],
-)
+granularity = 8
+page_bytes = 4096
+max_class_size = 2048
 
-slab_offset = 0
-for max_size in ranges:
+def make_slab_class(max_size, slab_offset):
     slab_space = target_slab_bytes - slab_header_bytes
     slab_count = min(max_slab_count, slab_space // max_size)
-    size_classes.append(SizeClass(max_size, slab_offset, slab_count))
-    slab_offset += slab_count
+    return SizeClass(max_size, slab_offset, slab_count)
+
+def default_class_sizes():
+    return list(chain(
+        range(  16,    64,     8),
+        range(  64,   128,    16),
+        range( 128,   256,    32),
+        range( 256,   512,    64),
+        range( 512,  2048,   256),
+        [2048],
+    ))
+
+def read_profile(path):
+    """Read an allocation histogram written by `ebi_dump_alloc_profile()`.
+    Returns allocation counts per `granularity` sized bucket."""
+    counts = [0] * (max_class_size // granularity + 1)
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line or line.startswith("#"): continue
+            size, count = line.split(maxsplit=2)[:2]
+            size, count = int(size), int(count)
+            if size > max_class_size: continue
+            counts[max(size - 1, 0) // granularity + 1] += count
+    return counts
+
+def profile_class_sizes(counts, num_classes, prior):
+    """Pick `num_classes` class sizes minimizing the expected wasted bytes per
+    allocation for the histogram `counts`: the slot slack of each object plus
+    its share of unused resident space at the end of the slab. `prior` spreads a small
+    fraction of the allocations uniformly so unprofiled sizes stay reasonable."""
+    num = max_class_size // granularity
+    total = sum(counts)
+    weights = [0.0] + [c + prior * total / num for c in counts[1:]]
+
+    # Only the touched pages of a slab are resident so count the slack up to
+    # the next page boundary instead of the whole slab.
+    def slot_waste(size):
+        slab_count = make_slab_class(size, 0).slab_count
+        used = slab_header_bytes + slab_count * size
+        resident = min(target_slab_bytes, -(-used // page_bytes) * page_bytes)
+        return (resident - used) / slab_count
+
+    # Prefix sums so the cost of a class covering buckets (lo, hi] is O(1)
+    pw, pws = [0.0], [0.0]
+    for i in range(1, num + 1):
+        pw.append(pw[-1] + weights[i])
+        pws.append(pws[-1] + weights[i] * i * granularity)
+
+    def cost(lo, hi):
+        size = hi * granularity
+        w = pw[hi] - pw[lo]
+        return w * (size + slot_waste(size)) - (pws[hi] - pws[lo])
+
+    # best[k][i]: minimum cost covering buckets 1..i with k classes, the last
+    # class ending exactly at bucket i.
+    inf = float("inf")
+    best = [[inf] * (num + 1) for _ in range(num_classes + 1)]
+    prev = [[0] * (num + 1) for _ in range(num_classes + 1)]
+    best[0][0] = 0.0
+    for k in range(1, num_classes + 1):
+        for i in range(1, num + 1):
+            for j in range(k - 1, i):
+                c = best[k - 1][j] + cost(j, i)
+                if c < best[k][i]:
+                    best[k][i] = c
+                    prev[k][i] = j
+
+    sizes = []
+    i = num
+    for k in range(num_classes, 0, -1):
+        sizes.append(i * granularity)
+        i = prev[k][i]
+    return sorted(sizes)
+
+parser = argparse.ArgumentParser(description="Generate ebi heap size class tables")
+parser.add_argument("--profile", help="allocation profile from ebi_dump_alloc_profile()")
+parser.add_argument("--classes", type=int, default=25, help="number of size classes with --profile")
+parser.add_argument("--prior", type=float, default=0.01, help="fraction of uniform allocations mixed into the profile")
+args = parser.parse_args()
+
+if args.profile:
+    class_sizes = profile_class_sizes(read_profile(args.profile), args.classes, args.prior)
+else:
+    class_sizes = default_class_sizes()
+
+size_classes = []
+slab_offset = 0
+for max_size in class_sizes:
+    size_classes.append(make_slab_class(max_size, slab_offset))
+    slab_offset += size_classes[-1].slab_count
+
+# Slot indices are stored as `uint8_t` and offsets as `uint16_t`
+assert max(s.slab_count for s in size_classes) <= max_slab_count
+assert slab_offset <= 0xffff
 
 sizes = [s.max_size for s in size_classes]
 
 size_to_class = []
 
-for size in range(16, 2048+1, 16):
+for size in range(granularity, max_class_size+1, granularity):
     ix = bisect_left(sizes, size)
     size_to_class.append(ix)
 
@@ -40,6 +127,7 @@ def format_cols(data, fmt, sep, num_cols):
 
 print("// Generated by misc/make_heap_sizes.py")
 print(f"#define EBI_HEAP_CLASSES {len(sizes)}")
+print(f"#define EBI_HEAP_GRANULARITY {granularity}")
 print(f"#define EBI_HEAP_SLAB_OFFSETS {slab_offset}")
 print("")
 print(f"extern const ebi_heap_class ebi_heap_classes[EBI_HEAP_CLASSES];")
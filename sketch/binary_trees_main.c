@@ -0,0 +1,89 @@
+// Memory used by binary-trees style small objects.
+//
+// Builds complete binary trees of nodes with two references through the
+// public allocation API and reports the live slot bytes and RSS per node.
+// Each node has 16 bytes of data so the object header is a large part of it.
+//
+//   cc -O2 -pthread sketch/binary_trees_main.c src/ebi_core.c src/ebi_heap.c src/ebi_sync.c src/ebi_os.c -o binary_trees
+//   ./binary_trees [depth] [trees]
+
+#define _GNU_SOURCE
+
+#include "../src/ebi_core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct tree_node tree_node;
+struct tree_node {
+	tree_node *left;
+	tree_node *right;
+};
+
+static size_t rss_bytes()
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (!f) return 0;
+	unsigned long size = 0, resident = 0;
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+	fclose(f);
+	return (size_t)resident * 4096;
+}
+
+static ebi_type *make_node_type()
+{
+	ebi_type *ref = (ebi_type*)calloc(1, sizeof(ebi_type));
+	ref->flags = EBI_TYPE_IS_REF;
+	ref->data_size = sizeof(void*);
+
+	ebi_type *node = (ebi_type*)calloc(1, sizeof(ebi_type) + 2 * sizeof(ebi_field));
+	node->flags = EBI_TYPE_HAS_REFS;
+	node->data_size = sizeof(tree_node);
+	node->num_fields = 2;
+	node->fields[0].type = ref;
+	node->fields[0].offset = (uint32_t)offsetof(tree_node, left);
+	node->fields[0].flags = EBI_FIELD_IS_REF;
+	node->fields[1].type = ref;
+	node->fields[1].offset = (uint32_t)offsetof(tree_node, right);
+	node->fields[1].flags = EBI_FIELD_IS_REF;
+	ebi_init_type(node);
+	return node;
+}
+
+static tree_node *make_tree(ebi_thread *et, ebi_type *type, uint32_t depth)
+{
+	// No collection runs during the benchmark so plain stores are fine
+	tree_node *node = (tree_node*)ebi_new(et, type);
+	if (depth > 0) {
+		node->left = make_tree(et, type, depth - 1);
+		node->right = make_tree(et, type, depth - 1);
+	}
+	return node;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t depth = argc > 1 ? (uint32_t)atoi(argv[1]) : 20;
+	uint32_t num_trees = argc > 2 ? (uint32_t)atoi(argv[2]) : 4;
+
+	ebi_vm *vm = ebi_make_vm();
+	ebi_thread *et = ebi_make_thread(vm);
+	ebi_type *type = make_node_type();
+
+	size_t rss_begin = rss_bytes();
+	for (uint32_t i = 0; i < num_trees; i++) {
+		make_tree(et, type, depth);
+		ebi_checkpoint(et);
+	}
+	size_t rss = rss_bytes() - rss_begin;
+
+	ebi_heap_stats stats;
+	ebi_get_heap_stats(vm, &stats);
+
+	double num_nodes = (double)num_trees * (double)((2ull << depth) - 1);
+	printf("%.0f nodes of %zu bytes\n", num_nodes, sizeof(tree_node));
+	printf("live %8.2f MiB  %6.2f bytes/node\n", (double)stats.live_bytes / 1048576.0, (double)stats.live_bytes / num_nodes);
+	printf("rss  %8.2f MiB  %6.2f bytes/node\n", (double)rss / 1048576.0, (double)rss / num_nodes);
+	return 0;
+}
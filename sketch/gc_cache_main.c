@@ -0,0 +1,145 @@
+// Old generation growth of a cache that keeps replacing its entries.
+//
+// A large reference array is promoted to G by the first major collection and
+// then has random entries overwritten with new objects, the GC runs paced by
+// allocation like it would in the background. Promoting everything stored in
+// G keeps every entry until the next major collection while remembering the
+// references in cards lets replaced entries die in minor ones. The core is
+// compiled into this file to walk the slabs, build it twice to compare:
+//
+//   cc -O2 -pthread sketch/gc_cache_main.c src/ebi_heap.c src/ebi_sync.c src/ebi_os.c -o gc_cache
+//   cc -O2 -pthread -DEBI_GC_CARD_MARKING=0 sketch/gc_cache_main.c src/ebi_heap.c src/ebi_sync.c src/ebi_os.c -o gc_cache_promote
+//   ./gc_cache [log2_entries] [log2_stores] [entry_size]
+
+#define _GNU_SOURCE
+
+#include "../src/ebi_core.c"
+
+#include <stdio.h>
+#include <time.h>
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t rng_next(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return (uint32_t)(x >> 32);
+}
+
+// Bytes of G objects in slabs and spans.
+static size_t old_gen_bytes(ebi_vm *vm)
+{
+	ebi_heap *heap = &vm->heap;
+	size_t bytes = 0;
+
+	ebi_mutex_lock(&heap->reserve_mutex);
+	for (size_t ri = 0; ri < heap->num_reservations; ri++) {
+		ebi_heap_reservation *res = &heap->reservations[ri];
+		for (char *ptr = res->begin; ptr != res->end; ptr += EBI_HEAP_SLAB_SIZE) {
+			ebi_slab *slab = (ebi_slab*)ptr;
+			if (slab->state == EBI_SLAB_UNUSED || slab->state == EBI_SLAB_EMPTY) continue;
+			uint32_t slab_count = ebi_heap_classes[slab->cls].slab_count;
+			for (uint32_t slot = 0; slot < slab_count; slot++) {
+				if (slab->gen_g[slot]) bytes += slab->stride;
+			}
+		}
+	}
+	ebi_mutex_unlock(&heap->reserve_mutex);
+
+	ebi_mutex_lock(&heap->span_mutex);
+	for (ebi_span *span = heap->live_spans; span; span = span->live_next) {
+		if (ebi_heap_get_slab(span)->gen_g[0]) bytes += span->size;
+	}
+	ebi_mutex_unlock(&heap->span_mutex);
+	return bytes;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t log2_entries = argc > 1 ? (uint32_t)atoi(argv[1]) : 16;
+	uint32_t log2_stores = argc > 2 ? (uint32_t)atoi(argv[2]) : 24;
+	uint32_t entry_size = argc > 3 ? (uint32_t)atoi(argv[3]) : 64;
+	size_t num_entries = (size_t)1 << log2_entries;
+	size_t num_stores = (size_t)1 << log2_stores;
+
+	ebi_vm *vm = ebi_make_vm();
+	ebi_thread *et = ebi_make_thread(vm);
+
+	ebi_type *ref = (ebi_type*)calloc(1, sizeof(ebi_type));
+	ref->flags = EBI_TYPE_IS_REF;
+	ref->data_size = sizeof(void*);
+
+	ebi_type *entry = (ebi_type*)calloc(1, sizeof(ebi_type));
+	entry->data_size = entry_size;
+
+	// The suffix element type is stored after the fields
+	ebi_type *array = (ebi_type*)calloc(1, sizeof(ebi_type) + sizeof(ebi_field));
+	array->flags = EBI_TYPE_HAS_REFS | EBI_TYPE_HAS_SUFFIX;
+	array->data_size = sizeof(size_t);
+	array->elem_size = sizeof(void*);
+	array->fields[0].type = ref;
+	ebi_init_type(array);
+
+	// No collection runs while building so plain stores are fine
+	size_t *cache = (size_t*)ebi_new_array(et, array, num_entries);
+	void **entries = (void**)(cache + 1);
+	for (size_t i = 0; i < num_entries; i++) {
+		entries[i] = ebi_new(et, entry);
+	}
+
+	// Start with a major collection so the cache is in G
+	vm->gc_minor_cycles = EBI_GC_MAX_MINOR_CYCLES;
+
+	uint64_t rng = 0x9e3779b97f4a7c15ull;
+	uint32_t num_minor = 0, num_major = 0;
+	size_t minor_growth = 0, prev_old = 0, peak_old = 0, peak_heap = 0;
+	uint64_t begin = now_ns();
+	for (size_t i = 0; i < num_stores; i++) {
+		size_t ix = rng_next(&rng) & (num_entries - 1);
+		ebi_assign_ref(et, cache, sizeof(size_t) + ix * sizeof(void*), ebi_new(et, entry));
+		if (!ebi_gc_pending(vm)) continue;
+
+		// There are no globals to mark yet, mark the cache as the root
+		ebi_gc_stage stage = vm->gc_stage;
+		ebi_gc_step(et);
+		if (stage == EBI_GC_START && vm->gc_stage == EBI_GC_MARK) {
+			ebi_mark(et, cache, vm->gc_major);
+		}
+
+		if (stage != EBI_GC_IDLE && vm->gc_stage == EBI_GC_IDLE) {
+			// Minor collections never free G objects
+			size_t old = old_gen_bytes(vm);
+			if (vm->gc_major) {
+				num_major++;
+			} else {
+				num_minor++;
+				minor_growth += old - prev_old;
+			}
+			prev_old = old;
+			if (old > peak_old) peak_old = old;
+
+			ebi_heap_stats stats;
+			ebi_get_heap_stats(vm, &stats);
+			size_t heap = stats.slab_bytes + stats.large_bytes;
+			if (heap > peak_heap) peak_heap = heap;
+		}
+	}
+	uint64_t elapsed = now_ns() - begin;
+
+	printf("cards %d: %zu entries %zu stores: %3u minor %3u major  old gen growth %8.1f KiB/minor  "
+		"peak old gen %7.2f MiB  peak heap %7.2f MiB  %5.1f ns/store\n",
+		EBI_GC_CARD_MARKING, num_entries, num_stores, num_minor, num_major,
+		num_minor ? (double)minor_growth / 1024.0 / (double)num_minor : 0.0,
+		(double)peak_old / 1048576.0, (double)peak_heap / 1048576.0,
+		(double)elapsed / (double)num_stores);
+	return 0;
+}
@@ -0,0 +1,117 @@
+// GC CPU usage of paced background workers compared to a thread looping on
+// `ebi_gc_step()`.
+//
+// The mutator allocates short lived objects at a fixed rate and sleeps in
+// between, the GC CPU time is the process CPU time minus the mutator thread.
+// Workers should scale their CPU time with the allocation rate while the
+// loop keeps a core busy regardless. A rate of 0 allocates as fast as
+// possible, the peak heap size shows if the collector keeps up.
+//
+//   cc -O2 -pthread sketch/gc_pacing_main.c src/ebi_core.c src/ebi_heap.c src/ebi_sync.c src/ebi_os.c -o gc_pacing
+//   ./gc_pacing loop|workers [mib_per_sec] [seconds] [workers]
+
+#define _GNU_SOURCE
+
+#include "../src/ebi_core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef struct {
+	ebi_vm *vm;
+	volatile bool stop;
+} loop_state;
+
+static uint64_t clock_ns(clockid_t id)
+{
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void *loop_main(void *user)
+{
+	loop_state *s = (loop_state*)user;
+	ebi_thread *et = ebi_make_thread(s->vm);
+	while (!s->stop) {
+		ebi_lock_thread(et);
+		ebi_gc_step(et);
+		ebi_unlock_thread(et);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	bool use_workers = argc > 1 && !strcmp(argv[1], "workers");
+	double mib_per_sec = argc > 2 ? atof(argv[2]) : 64.0;
+	double seconds = argc > 3 ? atof(argv[3]) : 4.0;
+	uint32_t num_workers = argc > 4 ? (uint32_t)atoi(argv[4]) : 2;
+
+	ebi_vm *vm = ebi_make_vm();
+	ebi_thread *et = ebi_make_thread(vm);
+
+	ebi_type *type = (ebi_type*)calloc(1, sizeof(ebi_type));
+	type->data_size = 24;
+
+	loop_state loop = { vm, false };
+	pthread_t loop_thread;
+	if (use_workers) {
+		ebi_gc_start_workers(vm, num_workers);
+	} else {
+		pthread_create(&loop_thread, NULL, loop_main, &loop);
+	}
+
+	// Allocate in 10 ms slices
+	const uint64_t slice_ns = 10000000;
+	size_t obj_size = 32;
+	size_t objs_per_slice = mib_per_sec > 0.0 ? (size_t)(mib_per_sec * 1048576.0 * 0.01) / obj_size : 65536;
+
+	uint64_t cpu_begin = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+	uint64_t mut_begin = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	uint64_t begin = clock_ns(CLOCK_MONOTONIC);
+	uint64_t end = begin + (uint64_t)(seconds * 1e9);
+	size_t allocated = 0, peak_heap = 0;
+	ebi_heap_stats stats;
+	for (uint64_t slice = begin; slice < end; slice += slice_ns) {
+		ebi_lock_thread(et);
+		for (size_t i = 0; i < objs_per_slice; i++) {
+			ebi_new(et, type);
+			if (i % 1024 == 0) ebi_checkpoint(et);
+		}
+		ebi_unlock_thread(et);
+		allocated += objs_per_slice * obj_size;
+
+		ebi_get_heap_stats(vm, &stats);
+		size_t heap = stats.slab_bytes + stats.large_bytes;
+		if (heap > peak_heap) peak_heap = heap;
+
+		uint64_t now = clock_ns(CLOCK_MONOTONIC);
+		if (mib_per_sec <= 0.0) {
+			slice = now;
+			if (now >= end) break;
+		} else if (now < slice + slice_ns) {
+			uint64_t wait = slice + slice_ns - now;
+			struct timespec ts = { (time_t)(wait / 1000000000u), (long)(wait % 1000000000u) };
+			nanosleep(&ts, NULL);
+		}
+	}
+	uint64_t mut_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - mut_begin;
+	uint64_t cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_begin;
+	double wall = (double)(clock_ns(CLOCK_MONOTONIC) - begin) * 1e-9;
+
+	double gc_sec = (double)(cpu_ns - mut_ns) * 1e-9;
+	printf("%-7s %8.1f MiB/s: gc cpu %6.3f s (%5.1f%% of a core)  %7.3f ms/MiB  peak heap %8.2f MiB\n",
+		use_workers ? "workers" : "loop", (double)allocated / 1048576.0 / wall,
+		gc_sec, 100.0 * gc_sec / wall, 1e3 * gc_sec / ((double)allocated / 1048576.0),
+		(double)peak_heap / 1048576.0);
+
+	if (!use_workers) {
+		loop.stop = true;
+		pthread_join(loop_thread, NULL);
+	}
+	return 0;
+}
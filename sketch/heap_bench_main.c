@@ -0,0 +1,164 @@
+// Allocation throughput of the slab heap compared to malloc.
+//
+// Each thread allocates a batch of small objects of random sizes, touches
+// them and frees them again. Alloc and free are timed separately. The free
+// pass frees the batch of the *next* thread to include cross-thread frees.
+//
+//   cc -O2 -pthread sketch/heap_bench_main.c src/ebi_heap.c src/ebi_sync.c src/ebi_os.c -o heap_bench
+//   ./heap_bench [batch] [rounds] [max_size]
+
+#define _GNU_SOURCE
+
+#include "../src/ebi_heap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_THREADS 64
+
+typedef struct bench_state bench_state;
+
+typedef struct {
+	bench_state *state;
+	uint32_t id;
+	ebi_heap_cache *cache;
+	void **allocs;
+	uint32_t *sizes;
+	uint64_t alloc_ns;
+	uint64_t free_ns;
+} bench_thread;
+
+struct bench_state {
+	bool use_malloc;
+	ebi_heap heap;
+	uint32_t num_threads;
+	uint32_t batch;
+	uint32_t rounds;
+	bench_thread threads[MAX_THREADS];
+	pthread_barrier_t barrier;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void *bench_thread_main(void *user)
+{
+	bench_thread *bt = (bench_thread*)user;
+	bench_state *s = bt->state;
+	bench_thread *other = &s->threads[(bt->id + 1) % s->num_threads];
+
+	for (uint32_t round = 0; round < s->rounds; round++) {
+		uint64_t t0 = now_ns();
+		if (s->use_malloc) {
+			for (uint32_t i = 0; i < s->batch; i++) {
+				bt->allocs[i] = malloc(bt->sizes[i]);
+				*(uint32_t*)bt->allocs[i] = i;
+			}
+		} else {
+			for (uint32_t i = 0; i < s->batch; i++) {
+				bt->allocs[i] = ebi_heap_alloc(bt->cache, bt->sizes[i]);
+				*(uint32_t*)bt->allocs[i] = i;
+			}
+		}
+		uint64_t t1 = now_ns();
+
+		// Wait for all threads so we can free someone else's objects
+		pthread_barrier_wait(&s->barrier);
+
+		uint64_t t2 = now_ns();
+		if (s->use_malloc) {
+			for (uint32_t i = 0; i < s->batch; i++) {
+				free(other->allocs[i]);
+			}
+		} else {
+			for (uint32_t i = 0; i < s->batch; i++) {
+				ebi_heap_free(&s->heap, other->allocs[i]);
+			}
+		}
+		uint64_t t3 = now_ns();
+
+		pthread_barrier_wait(&s->barrier);
+
+		bt->alloc_ns += t1 - t0;
+		bt->free_ns += t3 - t2;
+	}
+
+	return NULL;
+}
+
+static void run(uint32_t num_threads, bool use_malloc, uint32_t batch, uint32_t rounds, uint32_t max_size)
+{
+	bench_state *s = (bench_state*)calloc(1, sizeof(bench_state));
+	s->use_malloc = use_malloc;
+	s->num_threads = num_threads;
+	s->batch = batch;
+	s->rounds = rounds;
+	pthread_barrier_init(&s->barrier, NULL, num_threads);
+	ebi_heap_init(&s->heap);
+
+	uint64_t rng = 0x9e3779b97f4a7c15ull;
+	for (uint32_t i = 0; i < num_threads; i++) {
+		bench_thread *bt = &s->threads[i];
+		bt->state = s;
+		bt->id = i;
+		bt->cache = (ebi_heap_cache*)calloc(1, sizeof(ebi_heap_cache));
+		ebi_heap_init_cache(bt->cache, &s->heap);
+		bt->allocs = (void**)malloc(batch * sizeof(void*));
+		bt->sizes = (uint32_t*)malloc(batch * sizeof(uint32_t));
+		for (uint32_t j = 0; j < batch; j++) {
+			rng ^= rng << 13;
+			rng ^= rng >> 7;
+			rng ^= rng << 17;
+			bt->sizes[j] = 16 + (uint32_t)(rng >> 32) % (max_size - 15);
+		}
+	}
+
+	pthread_t threads[MAX_THREADS];
+	for (uint32_t i = 0; i < num_threads; i++) {
+		pthread_create(&threads[i], NULL, bench_thread_main, &s->threads[i]);
+	}
+
+	uint64_t alloc_ns = 0, free_ns = 0;
+	for (uint32_t i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+		alloc_ns += s->threads[i].alloc_ns;
+		free_ns += s->threads[i].free_ns;
+	}
+
+	double ops = (double)batch * (double)rounds * (double)num_threads;
+	printf("%-6s %3u threads: alloc %6.2f ns/op  free %6.2f ns/op\n",
+		use_malloc ? "malloc" : "ebi", num_threads,
+		(double)alloc_ns / ops, (double)free_ns / ops);
+
+	// Slabs are not returned to the OS, the address space is leaked per run
+	for (uint32_t i = 0; i < num_threads; i++) {
+		free(s->threads[i].cache);
+		free(s->threads[i].allocs);
+		free(s->threads[i].sizes);
+	}
+	pthread_barrier_destroy(&s->barrier);
+	free(s);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t batch = argc > 1 ? (uint32_t)atoi(argv[1]) : 100000;
+	uint32_t rounds = argc > 2 ? (uint32_t)atoi(argv[2]) : 50;
+	uint32_t max_size = argc > 3 ? (uint32_t)atoi(argv[3]) : 256;
+	if (max_size < 16) max_size = 16;
+	if (max_size > EBI_HEAP_MAX_CLASS_SIZE) max_size = EBI_HEAP_MAX_CLASS_SIZE;
+
+	for (uint32_t n = 1; n <= 8; n *= 2) {
+		run(n, true, batch, rounds, max_size);
+		run(n, false, batch, rounds, max_size);
+	}
+
+	return 0;
+}
@@ -0,0 +1,152 @@
+// Mark throughput on a large slab heap with and without transparent huge
+// pages.
+//
+// Builds a random graph of small nodes allocated from `ebi_heap` and times a
+// depth-first marking pass over it, like `ebi_gc_mark()` does. The nodes are
+// spread over many slabs so most edges land on a different page and a 4 KiB
+// page heap spends a good part of the traversal walking page tables.
+//
+//   cc -O2 -pthread sketch/huge_page_bench_main.c src/ebi_heap.c src/ebi_sync.c src/ebi_os.c -o huge_page_bench
+//   ./huge_page_bench [log2_nodes] [rounds]
+//
+// The default of 2^25 nodes spreads over 4 GiB of slabs. THP must be set to
+// `madvise` or `always` in /sys/kernel/mm/transparent_hugepage/enabled, the
+// `AnonHugePages` column shows how much of the heap actually got them. Note
+// that huge pages also back the slab tails small classes never touch.
+
+#define _GNU_SOURCE
+
+#include "../src/ebi_heap.h"
+#include "../src/ebi_os.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_EDGES 4
+
+typedef struct node node;
+struct node {
+	uint32_t mark;
+	uint32_t pad;
+	node *edges[NUM_EDGES];
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t rng_next(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return (uint32_t)(x >> 32);
+}
+
+// Size of transparent huge pages mapped by the process in KiB.
+static size_t anon_huge_kib()
+{
+	FILE *f = fopen("/proc/self/smaps_rollup", "r");
+	if (!f) return 0;
+	char line[256];
+	size_t kib = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "AnonHugePages: %zu kB", &kib) == 1) break;
+	}
+	fclose(f);
+	return kib;
+}
+
+static size_t mark_graph(node **roots, uint32_t num_roots, node **stack, uint32_t mark)
+{
+	size_t marked = 0;
+	for (uint32_t ri = 0; ri < num_roots; ri++) {
+		size_t top = 0;
+		if (roots[ri]->mark == mark) continue;
+		roots[ri]->mark = mark;
+		stack[top++] = roots[ri];
+		while (top > 0) {
+			node *n = stack[--top];
+			marked++;
+			for (uint32_t i = 0; i < NUM_EDGES; i++) {
+				node *e = n->edges[i];
+				if (e->mark == mark) continue;
+				e->mark = mark;
+				stack[top++] = e;
+			}
+		}
+	}
+	return marked;
+}
+
+static void run(bool huge_pages, uint32_t log2_nodes, uint32_t rounds)
+{
+	ebi_heap *heap = (ebi_heap*)calloc(1, sizeof(ebi_heap));
+	ebi_heap_init(heap);
+	heap->huge_pages = huge_pages;
+
+	ebi_heap_cache *cache = (ebi_heap_cache*)calloc(1, sizeof(ebi_heap_cache));
+	ebi_heap_init_cache(cache, heap);
+
+	size_t num_nodes = (size_t)1 << log2_nodes;
+	node **nodes = (node**)malloc(num_nodes * sizeof(node*));
+	for (size_t i = 0; i < num_nodes; i++) {
+		nodes[i] = (node*)ebi_heap_alloc(cache, sizeof(node));
+		nodes[i]->mark = 0;
+	}
+
+	uint64_t rng = 0x9e3779b97f4a7c15ull;
+	for (size_t i = 0; i < num_nodes; i++) {
+		for (uint32_t j = 0; j < NUM_EDGES; j++) {
+			nodes[i]->edges[j] = nodes[rng_next(&rng) & (num_nodes - 1)];
+		}
+	}
+
+	// Every node can be on the stack at most once per pass
+	node **stack = (node**)malloc(num_nodes * sizeof(node*));
+	const uint32_t num_roots = 256;
+	node *roots[256];
+	for (uint32_t i = 0; i < num_roots; i++) {
+		roots[i] = nodes[(size_t)i * num_nodes / num_roots];
+	}
+	free(nodes);
+
+	uint64_t best = UINT64_MAX;
+	size_t marked = 0;
+	for (uint32_t round = 1; round <= rounds; round++) {
+		uint64_t begin = now_ns();
+		marked = mark_graph(roots, num_roots, stack, round);
+		uint64_t elapsed = now_ns() - begin;
+		if (elapsed < best) best = elapsed;
+	}
+
+	printf("%-5s %10zu nodes: %8.2f ms  %8.2f Mnodes/s  AnonHugePages %zu MiB\n",
+		huge_pages ? "huge" : "small", marked, (double)best * 1e-6,
+		(double)marked / ((double)best * 1e-3), anon_huge_kib() / 1024);
+
+	for (size_t i = 0; i < heap->num_reservations; i++) {
+		ebi_heap_reservation *res = &heap->reservations[i];
+		ebi_os_release(res->begin, (size_t)(res->end - res->begin));
+	}
+	free(heap->reservations);
+	free(stack);
+	free(cache);
+	free(heap);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t log2_nodes = argc > 1 ? (uint32_t)atoi(argv[1]) : 25;
+	uint32_t rounds = argc > 2 ? (uint32_t)atoi(argv[2]) : 3;
+
+	run(false, log2_nodes, rounds);
+	run(true, log2_nodes, rounds);
+	return 0;
+}
@@ -0,0 +1,141 @@
+// Parallel marking of a single huge reference array.
+//
+// Allocates one suffix array of references to a small set of leaf objects
+// and times marking it with a number of threads stealing from each other.
+// Suffix arrays are split into range tasks of `EBI_MARK_RANGE_SIZE` elements
+// so all threads should take part, define it huge to mark in one piece.
+// The core is compiled into this file to reach the mark loop directly.
+//
+//   cc -O2 -pthread sketch/mark_array_main.c src/ebi_heap.c src/ebi_sync.c src/ebi_os.c -o mark_array
+//   cc -O2 -pthread -DEBI_MARK_RANGE_SIZE=0xffffffffu sketch/mark_array_main.c src/ebi_heap.c src/ebi_sync.c src/ebi_os.c -o mark_array_whole
+//   ./mark_array [log2_elements] [max_threads]
+
+#define _GNU_SOURCE
+
+#include "../src/ebi_core.c"
+
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_THREADS 64
+#define NUM_LEAVES 65536
+
+typedef struct {
+	ebi_thread *threads[MAX_THREADS];
+	uint32_t num_threads;
+	uint32_t active;
+	uint32_t lists[MAX_THREADS];
+} mark_state;
+
+static mark_state state;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Mark until every thread runs out of work at the same time.
+static void *mark_main(void *user)
+{
+	uint32_t ix = (uint32_t)(uintptr_t)user;
+	ebi_thread *et = state.threads[ix];
+	ebi_vm *vm = et->vm;
+	for (;;) {
+		if (ebi_gc_mark(et)) {
+			state.lists[ix]++;
+			continue;
+		}
+		if (et->objs_mark->count > 0) {
+			ebi_flush_marks(et);
+			continue;
+		}
+
+		ebi_atomic_add32(&state.active, (uint32_t)-1);
+		for (;;) {
+			uintptr_t count;
+			if (ebi_gc_mark_pending(vm, &count)) {
+				ebi_atomic_add32(&state.active, 1);
+				break;
+			}
+			if (ebi_atomic_load32_acquire(&state.active) == 0) return NULL;
+			ebi_pause();
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t log2_elems = argc > 1 ? (uint32_t)atoi(argv[1]) : 25;
+	uint32_t max_threads = argc > 2 ? (uint32_t)atoi(argv[2]) : 8;
+	if (max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+
+	ebi_vm *vm = ebi_make_vm();
+	for (uint32_t i = 0; i < max_threads; i++) {
+		state.threads[i] = ebi_make_thread(vm);
+	}
+	ebi_thread *et = state.threads[0];
+
+	ebi_type *ref = (ebi_type*)calloc(1, sizeof(ebi_type));
+	ref->flags = EBI_TYPE_IS_REF;
+	ref->data_size = sizeof(void*);
+
+	ebi_type *leaf = (ebi_type*)calloc(1, sizeof(ebi_type));
+	leaf->data_size = 16;
+
+	// The suffix element type is stored after the fields
+	ebi_type *array = (ebi_type*)calloc(1, sizeof(ebi_type) + sizeof(ebi_field));
+	array->flags = EBI_TYPE_HAS_REFS | EBI_TYPE_HAS_SUFFIX;
+	array->data_size = sizeof(size_t);
+	array->elem_size = sizeof(void*);
+	array->fields[0].type = ref;
+	ebi_init_type(array);
+
+	void **leaves = (void**)malloc(NUM_LEAVES * sizeof(void*));
+	for (uint32_t i = 0; i < NUM_LEAVES; i++) {
+		leaves[i] = ebi_new(et, leaf);
+	}
+
+	// No collection runs while building so plain stores are fine
+	size_t num_elems = (size_t)1 << log2_elems;
+	size_t *arr = (size_t*)ebi_new_array(et, array, num_elems);
+	void **elems = (void**)(arr + 1);
+	for (size_t i = 0; i < num_elems; i++) {
+		elems[i] = leaves[(i * 0x9e3779b1u) % NUM_LEAVES];
+	}
+
+	for (uint32_t num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+		// New N generation so everything is unmarked again
+		vm->gen.n = vm->gen.n == 255 ? 1 : vm->gen.n + 1;
+		for (uint32_t i = 0; i < max_threads; i++) {
+			state.threads[i]->gen = vm->gen;
+			state.lists[i] = 0;
+		}
+		state.num_threads = num_threads;
+		state.active = num_threads;
+
+		uint64_t begin = now_ns();
+		ebi_mark(et, arr, false);
+		ebi_flush_marks(et);
+
+		pthread_t threads[MAX_THREADS];
+		for (uint32_t i = 1; i < num_threads; i++) {
+			pthread_create(&threads[i], NULL, mark_main, (void*)(uintptr_t)i);
+		}
+		mark_main((void*)(uintptr_t)0);
+		for (uint32_t i = 1; i < num_threads; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		uint64_t elapsed = now_ns() - begin;
+
+		printf("%2u threads: %zu elements: %8.2f ms  %7.2f Melems/s  lists:",
+			num_threads, num_elems, (double)elapsed * 1e-6, (double)num_elems / ((double)elapsed * 1e-3));
+		for (uint32_t i = 0; i < num_threads; i++) {
+			printf(" %u", state.lists[i]);
+		}
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,301 @@
+// Mark scaling benchmark: parallel traversal of a random object graph using
+// per-thread `ebi_ws_deque` work-stealing queues compared to a single shared
+// `ebi_ia_stack` like the old global `vm->objs_mark`.
+//
+// Work is passed around in 64 entry chunks like `ebi_objlist`. All roots start
+// on the first thread so the other threads have to steal to get any work.
+//
+//   cc -O2 -pthread sketch/mark_bench_main.c src/ebi_sync.c -o mark_bench
+//   ./mark_bench [log2_nodes] [edges_per_node] [max_threads]
+
+#define _GNU_SOURCE
+
+#include "../src/ebi_sync.h"
+#include "../src/ebi_intrin.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define CHUNK_SIZE 64
+#define MAX_THREADS 64
+#define NUM_ROOTS 256
+
+typedef struct chunk chunk;
+struct chunk {
+	chunk *next;
+	uint32_t count;
+	uint32_t nodes[CHUNK_SIZE];
+};
+
+typedef struct {
+	uint32_t num_nodes;
+	uint32_t num_edges;
+	uint32_t *edges;
+	uint32_t *marks;
+} graph;
+
+typedef struct bench_thread bench_thread;
+
+typedef struct {
+	graph *g;
+	bool use_deque;
+	uint32_t num_threads;
+	bench_thread *threads;
+	ebi_ia_stack global;
+	uint32_t idle;
+	uint32_t start;
+} bench_state;
+
+struct bench_thread {
+	ebi_ws_deque deque;
+	bench_state *state;
+	uint32_t id;
+	uint32_t steal_index;
+	chunk *local;
+	chunk *free_chunks;
+	uint64_t marked;
+	uint64_t steals;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t rng_next(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return (uint32_t)(x >> 32);
+}
+
+static chunk *alloc_chunk(bench_thread *bt)
+{
+	chunk *c = bt->free_chunks;
+	if (c) {
+		bt->free_chunks = c->next;
+	} else {
+		c = (chunk*)malloc(sizeof(chunk));
+	}
+	c->next = NULL;
+	c->count = 0;
+	return c;
+}
+
+static void free_chunk(bench_thread *bt, chunk *c)
+{
+	c->next = bt->free_chunks;
+	bt->free_chunks = c;
+}
+
+static void push_chunk(bench_thread *bt, chunk *c)
+{
+	bench_state *s = bt->state;
+	if (s->use_deque && ebi_ws_push(&bt->deque, c)) return;
+	ebi_ia_push(&s->global, c);
+}
+
+static chunk *steal_chunk(bench_thread *bt)
+{
+	bench_state *s = bt->state;
+	uint32_t num = s->num_threads;
+	for (uint32_t i = 0; i < num; i++) {
+		uint32_t ix = (bt->steal_index + i) % num;
+		if (ix == bt->id) continue;
+		chunk *c = (chunk*)ebi_ws_steal(&s->threads[ix].deque);
+		if (c) {
+			bt->steal_index = ix;
+			bt->steals++;
+			return c;
+		}
+	}
+	return NULL;
+}
+
+static chunk *get_chunk(bench_thread *bt)
+{
+	bench_state *s = bt->state;
+	chunk *c = NULL;
+	if (s->use_deque) {
+		c = (chunk*)ebi_ws_pop(&bt->deque);
+		if (!c) c = (chunk*)ebi_ia_pop(&s->global);
+		if (!c) c = steal_chunk(bt);
+	} else {
+		c = (chunk*)ebi_ia_pop(&s->global);
+	}
+	return c;
+}
+
+static bool maybe_work(bench_state *s)
+{
+	if (ebi_ia_maybe_nonempty(&s->global)) return true;
+	if (s->use_deque) {
+		for (uint32_t i = 0; i < s->num_threads; i++) {
+			if (ebi_ws_maybe_nonempty(&s->threads[i].deque)) return true;
+		}
+	}
+	return false;
+}
+
+static ebi_forceinline void mark_node(bench_thread *bt, uint32_t node)
+{
+	graph *g = bt->state->g;
+	if (*(volatile uint32_t*)&g->marks[node]) return;
+	if (ebi_atomic_xhg32(&g->marks[node], 1) != 0) return;
+
+	chunk *c = bt->local;
+	if (c->count == CHUNK_SIZE) {
+		push_chunk(bt, c);
+		c = bt->local = alloc_chunk(bt);
+	}
+	c->nodes[c->count++] = node;
+}
+
+static void process_chunk(bench_thread *bt, chunk *c)
+{
+	graph *g = bt->state->g;
+	uint32_t num_edges = g->num_edges;
+	for (uint32_t i = 0; i < c->count; i++) {
+		const uint32_t *edges = g->edges + (size_t)c->nodes[i] * num_edges;
+		for (uint32_t j = 0; j < num_edges; j++) {
+			mark_node(bt, edges[j]);
+		}
+	}
+	bt->marked += c->count;
+	free_chunk(bt, c);
+}
+
+static void *bench_thread_main(void *user)
+{
+	bench_thread *bt = (bench_thread*)user;
+	bench_state *s = bt->state;
+
+	while (!ebi_atomic_load32_acquire(&s->start)) {
+		ebi_pause();
+	}
+
+	for (;;) {
+		chunk *c = get_chunk(bt);
+		if (c) {
+			process_chunk(bt, c);
+			continue;
+		}
+
+		if (bt->local->count > 0) {
+			c = bt->local;
+			bt->local = alloc_chunk(bt);
+			process_chunk(bt, c);
+			continue;
+		}
+
+		// Out of work: we're done once every thread is idle at the same time
+		ebi_atomic_add32(&s->idle, 1);
+		for (;;) {
+			if (maybe_work(s)) {
+				ebi_atomic_add32(&s->idle, (uint32_t)-1);
+				break;
+			}
+			if (ebi_atomic_load32_acquire(&s->idle) == s->num_threads) {
+				return NULL;
+			}
+			ebi_pause();
+		}
+	}
+}
+
+static void make_graph(graph *g, uint32_t log2_nodes, uint32_t num_edges)
+{
+	g->num_nodes = 1u << log2_nodes;
+	g->num_edges = num_edges;
+	g->edges = (uint32_t*)malloc((size_t)g->num_nodes * num_edges * sizeof(uint32_t));
+	g->marks = (uint32_t*)calloc(g->num_nodes, sizeof(uint32_t));
+
+	uint64_t rng = 0x9e3779b97f4a7c15ull;
+	for (size_t i = 0; i < (size_t)g->num_nodes * num_edges; i++) {
+		g->edges[i] = rng_next(&rng) & (g->num_nodes - 1);
+	}
+}
+
+static void run(graph *g, uint32_t num_threads, bool use_deque)
+{
+	memset(g->marks, 0, g->num_nodes * sizeof(uint32_t));
+
+	bench_state s = { 0 };
+	s.g = g;
+	s.use_deque = use_deque;
+	s.num_threads = num_threads;
+	s.threads = (bench_thread*)calloc(num_threads, sizeof(bench_thread));
+
+	for (uint32_t i = 0; i < num_threads; i++) {
+		bench_thread *bt = &s.threads[i];
+		bt->state = &s;
+		bt->id = i;
+		bt->steal_index = i + 1;
+		bt->local = alloc_chunk(bt);
+	}
+
+	// Seed the roots on the first thread
+	for (uint32_t i = 0; i < NUM_ROOTS; i++) {
+		mark_node(&s.threads[0], (uint32_t)((uint64_t)i * g->num_nodes / NUM_ROOTS));
+	}
+
+	pthread_t threads[MAX_THREADS];
+	for (uint32_t i = 0; i < num_threads; i++) {
+		pthread_create(&threads[i], NULL, bench_thread_main, &s.threads[i]);
+	}
+
+	uint64_t begin = now_ns();
+	ebi_atomic_store32_release(&s.start, 1);
+	for (uint32_t i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	uint64_t elapsed = now_ns() - begin;
+
+	uint64_t marked = 0, steals = 0;
+	for (uint32_t i = 0; i < num_threads; i++) {
+		bench_thread *bt = &s.threads[i];
+		marked += bt->marked;
+		steals += bt->steals;
+		free(bt->local);
+		while (bt->free_chunks) {
+			chunk *c = bt->free_chunks;
+			bt->free_chunks = c->next;
+			free(c);
+		}
+	}
+
+	printf("%-6s %3u threads: %8.2f ms  %8.2f Mnodes/s  %10llu marked  %8llu steals\n",
+		use_deque ? "deque" : "global", num_threads,
+		(double)elapsed * 1e-6, (double)marked / ((double)elapsed * 1e-3),
+		(unsigned long long)marked, (unsigned long long)steals);
+
+	free(s.threads);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t log2_nodes = argc > 1 ? (uint32_t)atoi(argv[1]) : 22;
+	uint32_t num_edges = argc > 2 ? (uint32_t)atoi(argv[2]) : 4;
+	uint32_t max_threads = argc > 3 ? (uint32_t)atoi(argv[3]) : 16;
+	if (max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+
+	graph g;
+	make_graph(&g, log2_nodes, num_edges);
+
+	for (uint32_t n = 1; n <= max_threads; n *= 2) {
+		run(&g, n, false);
+		run(&g, n, true);
+	}
+
+	free(g.edges);
+	free(g.marks);
+	return 0;
+}
@@ -0,0 +1,115 @@
+// Mark throughput of `ebi_gc_mark()` with and without the prefetch ring.
+//
+// Builds a random graph of objects with four references each, much larger
+// than the last level cache, and times marking all of it from a few roots.
+// The core is compiled into this file to reach the mark loop directly, build
+// it twice to compare:
+//
+//   cc -O2 -pthread sketch/mark_prefetch_main.c src/ebi_heap.c src/ebi_sync.c src/ebi_os.c -o mark_prefetch
+//   cc -O2 -pthread -DEBI_MARK_PREFETCH=0 sketch/mark_prefetch_main.c src/ebi_heap.c src/ebi_sync.c src/ebi_os.c -o mark_noprefetch
+//   ./mark_prefetch [log2_nodes] [rounds]
+
+#define _GNU_SOURCE
+
+#include "../src/ebi_core.c"
+
+#include <stdio.h>
+#include <time.h>
+
+#define NUM_EDGES 4
+
+typedef struct node node;
+struct node {
+	node *edges[NUM_EDGES];
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t rng_next(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return (uint32_t)(x >> 32);
+}
+
+static ebi_type *make_node_type()
+{
+	ebi_type *ref = (ebi_type*)calloc(1, sizeof(ebi_type));
+	ref->flags = EBI_TYPE_IS_REF;
+	ref->data_size = sizeof(void*);
+
+	ebi_type *type = (ebi_type*)calloc(1, sizeof(ebi_type) + NUM_EDGES * sizeof(ebi_field));
+	type->flags = EBI_TYPE_HAS_REFS;
+	type->data_size = sizeof(node);
+	type->num_fields = NUM_EDGES;
+	for (uint32_t i = 0; i < NUM_EDGES; i++) {
+		type->fields[i].type = ref;
+		type->fields[i].offset = (uint32_t)(i * sizeof(node*));
+		type->fields[i].flags = EBI_FIELD_IS_REF;
+	}
+	ebi_init_type(type);
+	return type;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t log2_nodes = argc > 1 ? (uint32_t)atoi(argv[1]) : 23;
+	uint32_t rounds = argc > 2 ? (uint32_t)atoi(argv[2]) : 5;
+
+	ebi_vm *vm = ebi_make_vm();
+	ebi_thread *et = ebi_make_thread(vm);
+	ebi_type *type = make_node_type();
+
+	// No collection runs while building so plain stores are fine
+	size_t num_nodes = (size_t)1 << log2_nodes;
+	node **nodes = (node**)malloc(num_nodes * sizeof(node*));
+	for (size_t i = 0; i < num_nodes; i++) {
+		nodes[i] = (node*)ebi_new(et, type);
+	}
+	uint64_t rng = 0x9e3779b97f4a7c15ull;
+	for (size_t i = 0; i < num_nodes; i++) {
+		for (uint32_t j = 0; j < NUM_EDGES; j++) {
+			nodes[i]->edges[j] = nodes[rng_next(&rng) & (num_nodes - 1)];
+		}
+	}
+
+	const uint32_t num_roots = 256;
+	node *roots[256];
+	for (uint32_t i = 0; i < num_roots; i++) {
+		roots[i] = nodes[(size_t)i * num_nodes / num_roots];
+	}
+	free(nodes);
+
+	uint64_t best = UINT64_MAX;
+	for (uint32_t round = 0; round < rounds; round++) {
+		// New N generation so every node is unmarked again
+		et->gen.n = vm->gen.n = vm->gen.n == 255 ? 1 : vm->gen.n + 1;
+
+		uint64_t begin = now_ns();
+		for (uint32_t i = 0; i < num_roots; i++) {
+			ebi_mark(et, roots[i], false);
+		}
+		for (;;) {
+			if (ebi_gc_mark(et)) continue;
+			if (et->objs_mark->count == 0) break;
+			ebi_flush_marks(et);
+		}
+		uint64_t elapsed = now_ns() - begin;
+		if (elapsed < best) best = elapsed;
+	}
+
+	ebi_heap_stats stats;
+	ebi_get_heap_stats(vm, &stats);
+	printf("prefetch %2d: %zu nodes (%.0f MiB): %8.2f ms  %7.2f Mnodes/s\n",
+		EBI_MARK_PREFETCH, num_nodes, (double)stats.slab_bytes / 1048576.0,
+		(double)best * 1e-6, (double)num_nodes / ((double)best * 1e-3));
+	return 0;
+}
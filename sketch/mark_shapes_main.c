@@ -0,0 +1,209 @@
+// Mark throughput per type shape with and without flattened reference maps.
+//
+// Builds a cache resident graph for each shape and times `ebi_gc_mark()`
+// over it walking the fields and with the map from `ebi_init_type()`,
+// alternating between the two so noise from other load hits both equally.
+// The first reference of each object follows a random cycle so everything
+// is reachable from one root, others point anywhere. The core is compiled
+// into this file to reach the mark loop directly, build with NDEBUG as
+// marking a type without a map is an assert failure otherwise.
+//
+//   cc -O2 -DNDEBUG -pthread sketch/mark_shapes_main.c src/ebi_heap.c src/ebi_sync.c src/ebi_os.c -o mark_shapes
+//   ./mark_shapes [log2_objects] [rounds]
+
+#define _GNU_SOURCE
+
+#include "../src/ebi_core.c"
+
+#include <stdio.h>
+#include <time.h>
+
+typedef struct pair {
+	uint64_t key;
+	void *value;
+} pair;
+
+typedef struct one_node {
+	uint64_t a;
+	void *next;
+	uint64_t b;
+} one_node;
+
+typedef struct all_node {
+	void *refs[4];
+} all_node;
+
+typedef struct nested_node {
+	pair pairs[3];
+} nested_node;
+
+typedef struct array_node {
+	size_t count;
+	pair pairs[];
+} array_node;
+
+#define ARRAY_COUNT 8
+
+static ebi_type *ref_type;
+static ebi_type *pair_type;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t rng_next(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return (uint32_t)(x >> 32);
+}
+
+static ebi_type *make_type(uint32_t data_size, uint32_t num_fields)
+{
+	ebi_type *type = (ebi_type*)calloc(1, sizeof(ebi_type) + (num_fields + 1) * sizeof(ebi_field));
+	type->flags = EBI_TYPE_HAS_REFS;
+	type->data_size = data_size;
+	type->num_fields = num_fields;
+	return type;
+}
+
+static void set_field(ebi_type *type, uint32_t ix, ebi_type *field_type, size_t offset)
+{
+	type->fields[ix].type = field_type;
+	type->fields[ix].offset = (uint32_t)offset;
+	type->fields[ix].flags = (field_type->flags & EBI_TYPE_IS_REF) ? EBI_FIELD_IS_REF : EBI_FIELD_HAS_REFS;
+}
+
+// Reference slots of an object of `type` at `data` to `slots`, returns the count.
+static uint32_t get_slots(ebi_type *type, char *data, void ***slots)
+{
+	uint32_t num = 0;
+	if (type->flags & EBI_TYPE_HAS_SUFFIX) {
+		array_node *node = (array_node*)data;
+		for (size_t i = 0; i < node->count; i++) slots[num++] = &node->pairs[i].value;
+		return num;
+	}
+	for (uint32_t i = 0; i < type->num_fields; i++) {
+		ebi_field *f = &type->fields[i];
+		if (f->type == ref_type) {
+			slots[num++] = (void**)(data + f->offset);
+		} else {
+			slots[num++] = (void**)(data + f->offset + offsetof(pair, value));
+		}
+	}
+	return num;
+}
+
+static uint64_t mark_round(ebi_vm *vm, ebi_thread *et, void *root)
+{
+	// New N generation so every object is unmarked again
+	et->gen.n = vm->gen.n = vm->gen.n == 255 ? 1 : vm->gen.n + 1;
+
+	uint64_t begin = now_ns();
+	ebi_mark(et, root, false);
+	for (;;) {
+		if (ebi_gc_mark(et)) continue;
+		if (et->objs_mark->count == 0) break;
+		ebi_flush_marks(et);
+	}
+	return now_ns() - begin;
+}
+
+static void run(ebi_vm *vm, ebi_thread *et, const char *name, ebi_type *type, uint32_t log2_objs, uint32_t rounds)
+{
+	size_t num_objs = (size_t)1 << log2_objs;
+	void **objs = (void**)malloc(num_objs * sizeof(void*));
+	size_t *order = (size_t*)malloc(num_objs * sizeof(size_t));
+	for (size_t i = 0; i < num_objs; i++) {
+		objs[i] = (type->flags & EBI_TYPE_HAS_SUFFIX) ? ebi_new_array(et, type, ARRAY_COUNT) : ebi_new(et, type);
+		order[i] = i;
+	}
+
+	uint64_t rng = 0x9e3779b97f4a7c15ull;
+	for (size_t i = num_objs - 1; i > 0; i--) {
+		size_t j = rng_next(&rng) % (i + 1);
+		size_t t = order[i]; order[i] = order[j]; order[j] = t;
+	}
+
+	// No collection runs while building so plain stores are fine
+	void **slots[64];
+	for (size_t i = 0; i < num_objs; i++) {
+		uint32_t num = get_slots(type, (char*)objs[order[i]], slots);
+		*slots[0] = objs[order[(i + 1) % num_objs]];
+		for (uint32_t j = 1; j < num; j++) {
+			*slots[j] = objs[rng_next(&rng) & (num_objs - 1)];
+		}
+	}
+
+	// Walk the fields by hiding the maps of the type and its suffix
+	ebi_init_type(type);
+	ebi_type *suf_type = (type->flags & EBI_TYPE_HAS_SUFFIX) ? type->fields[type->num_fields].type : NULL;
+	uint32_t mark = type->mark, suf_mark = suf_type ? suf_type->mark : 0;
+
+	uint64_t best_fields = UINT64_MAX, best_map = UINT64_MAX;
+	for (uint32_t round = 0; round < rounds; round++) {
+		type->mark = EBI_TYPE_MARK_FIELDS;
+		if (suf_type) suf_type->mark = EBI_TYPE_MARK_FIELDS;
+		uint64_t elapsed = mark_round(vm, et, objs[0]);
+		if (elapsed < best_fields) best_fields = elapsed;
+
+		type->mark = mark;
+		if (suf_type) suf_type->mark = suf_mark;
+		elapsed = mark_round(vm, et, objs[0]);
+		if (elapsed < best_map) best_map = elapsed;
+	}
+	double fields_ns = (double)best_fields, map_ns = (double)best_map;
+
+	printf("%-7s %zu objects: fields %7.2f ns/obj  map %7.2f ns/obj  (%.2fx)\n",
+		name, num_objs, fields_ns / (double)num_objs, map_ns / (double)num_objs, fields_ns / map_ns);
+
+	free(order);
+	free(objs);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t log2_objs = argc > 1 ? (uint32_t)atoi(argv[1]) : 14;
+	uint32_t rounds = argc > 2 ? (uint32_t)atoi(argv[2]) : 50;
+
+	ebi_vm *vm = ebi_make_vm();
+	ebi_thread *et = ebi_make_thread(vm);
+
+	ref_type = (ebi_type*)calloc(1, sizeof(ebi_type));
+	ref_type->flags = EBI_TYPE_IS_REF;
+	ref_type->data_size = sizeof(void*);
+
+	pair_type = make_type(sizeof(pair), 1);
+	set_field(pair_type, 0, ref_type, offsetof(pair, value));
+
+	ebi_type *one = make_type(sizeof(one_node), 1);
+	set_field(one, 0, ref_type, offsetof(one_node, next));
+
+	ebi_type *all = make_type(sizeof(all_node), 4);
+	for (uint32_t i = 0; i < 4; i++) {
+		set_field(all, i, ref_type, i * sizeof(void*));
+	}
+
+	ebi_type *nested = make_type(sizeof(nested_node), 3);
+	for (uint32_t i = 0; i < 3; i++) {
+		set_field(nested, i, pair_type, i * sizeof(pair));
+	}
+
+	// The suffix element type is stored after the fields
+	ebi_type *array = make_type(sizeof(array_node), 0);
+	array->flags |= EBI_TYPE_HAS_SUFFIX;
+	array->elem_size = sizeof(pair);
+	array->fields[0].type = pair_type;
+
+	run(vm, et, "one", one, log2_objs, rounds);
+	run(vm, et, "all", all, log2_objs, rounds);
+	run(vm, et, "nested", nested, log2_objs, rounds);
+	run(vm, et, "array", array, log2_objs, rounds);
+	return 0;
+}
@@ -0,0 +1,149 @@
+// Contention benchmark for `ebi_mutex` against `pthread_mutex_t`.
+//
+// Each thread repeatedly takes the lock, does a short critical section and
+// some work outside of the lock. Reports throughput and the handoff latency:
+// time from an unlock to the next lock by a *different* thread.
+//
+//   cc -O2 -pthread sketch/mutex_bench_main.c src/ebi_sync.c -o mutex_bench
+//   ./mutex_bench [duration_ms] [inside_work] [outside_work]
+
+#define _GNU_SOURCE
+
+#include "../src/ebi_sync.h"
+#include "../src/ebi_intrin.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef struct {
+	ebi_mutex ebi;
+	pthread_mutex_t pt;
+	bool use_pthread;
+
+	// Protected by the lock
+	uint64_t counter;
+	uint64_t last_unlock_ns;
+	uint32_t last_owner;
+	uint64_t handoffs;
+	uint64_t handoff_ns;
+
+	uint32_t inside_work;
+	uint32_t outside_work;
+	volatile uint32_t stop;
+} bench_state;
+
+typedef struct {
+	bench_state *state;
+	uint32_t id;
+	uint64_t ops;
+} bench_thread;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void work(uint32_t amount)
+{
+	for (uint32_t i = 0; i < amount; i++) {
+		ebi_pause();
+	}
+}
+
+static void *bench_thread_main(void *user)
+{
+	bench_thread *bt = (bench_thread*)user;
+	bench_state *s = bt->state;
+	uint64_t ops = 0;
+
+	while (!s->stop) {
+		if (s->use_pthread) {
+			pthread_mutex_lock(&s->pt);
+		} else {
+			ebi_mutex_lock(&s->ebi);
+		}
+
+		if (s->last_owner != bt->id) {
+			uint64_t t = now_ns();
+			if (s->last_unlock_ns) {
+				s->handoffs++;
+				s->handoff_ns += t - s->last_unlock_ns;
+			}
+			s->last_owner = bt->id;
+		}
+
+		s->counter++;
+		work(s->inside_work);
+		s->last_unlock_ns = now_ns();
+
+		if (s->use_pthread) {
+			pthread_mutex_unlock(&s->pt);
+		} else {
+			ebi_mutex_unlock(&s->ebi);
+		}
+
+		ops++;
+		work(s->outside_work);
+	}
+
+	bt->ops = ops;
+	return NULL;
+}
+
+static void run(uint32_t num_threads, bool use_pthread, uint32_t duration_ms, uint32_t inside_work, uint32_t outside_work)
+{
+	bench_state s = { 0 };
+	pthread_mutex_init(&s.pt, NULL);
+	s.use_pthread = use_pthread;
+	s.last_owner = UINT32_MAX;
+	s.inside_work = inside_work;
+	s.outside_work = outside_work;
+
+	pthread_t threads[64];
+	bench_thread bts[64];
+
+	uint64_t begin = now_ns();
+	for (uint32_t i = 0; i < num_threads; i++) {
+		bts[i].state = &s;
+		bts[i].id = i;
+		bts[i].ops = 0;
+		pthread_create(&threads[i], NULL, bench_thread_main, &bts[i]);
+	}
+
+	struct timespec ts = { duration_ms / 1000, (long)(duration_ms % 1000) * 1000000 };
+	nanosleep(&ts, NULL);
+	s.stop = 1;
+
+	uint64_t ops = 0;
+	for (uint32_t i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+		ops += bts[i].ops;
+	}
+	uint64_t elapsed = now_ns() - begin;
+
+	double mops = (double)ops / ((double)elapsed * 1e-3);
+	double handoff = s.handoffs ? (double)s.handoff_ns / (double)s.handoffs : 0.0;
+	printf("%-8s %3u threads: %8.3f Mops/s  %10llu handoffs  %9.1f ns/handoff\n",
+		use_pthread ? "pthread" : "ebi", num_threads, mops,
+		(unsigned long long)s.handoffs, handoff);
+
+	pthread_mutex_destroy(&s.pt);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t duration_ms = argc > 1 ? (uint32_t)atoi(argv[1]) : 500;
+	uint32_t inside_work = argc > 2 ? (uint32_t)atoi(argv[2]) : 20;
+	uint32_t outside_work = argc > 3 ? (uint32_t)atoi(argv[3]) : 100;
+
+	for (uint32_t n = 1; n <= 64; n *= 2) {
+		run(n, false, duration_ms, inside_work, outside_work);
+		run(n, true, duration_ms, inside_work, outside_work);
+	}
+
+	return 0;
+}
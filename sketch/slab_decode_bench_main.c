@@ -0,0 +1,142 @@
+// Benchmark and cross-check of the `ebi_slab_get_free()` mask decoders.
+//
+// Generates random free masks of varying density for every size class,
+// verifies that all decoders supported by the CPU produce identical slot
+// lists and reports the time per decoded slab.
+//
+//   cc -O2 sketch/slab_decode_bench_main.c src/ebi_heap.c src/ebi_sync.c src/ebi_os.c -o slab_decode_bench
+//   ./slab_decode_bench [iterations]
+
+#define _GNU_SOURCE
+
+#include "../src/ebi_heap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_SAMPLES 4096
+
+static const char *decoder_names[EBI_SLAB_DECODE_COUNT] = {
+	"swar", "avx2", "avx512vbmi2",
+};
+
+typedef struct {
+	uint32_t masks[EBI_SLAB_MAX_MASKS];
+	uint32_t num_masks;
+} sample;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t rng_next(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return (uint32_t)(x >> 32);
+}
+
+// Random masks where each valid slot is free with probability `density`%.
+static void make_samples(sample *samples, uint32_t slab_count, uint32_t density, uint64_t *rng)
+{
+	for (uint32_t s = 0; s < NUM_SAMPLES; s++) {
+		sample *sm = &samples[s];
+		memset(sm->masks, 0, sizeof(sm->masks));
+		sm->num_masks = (slab_count + 31) / 32;
+		for (uint32_t i = 0; i < slab_count; i++) {
+			if (rng_next(rng) % 100 < density) {
+				sm->masks[i / 32] |= 1u << (i % 32);
+			}
+		}
+	}
+}
+
+static bool verify(const sample *samples)
+{
+	for (uint32_t s = 0; s < NUM_SAMPLES; s++) {
+		const sample *sm = &samples[s];
+		uint8_t ref[EBI_SLAB_MAX_SLOTS];
+		size_t ref_count = ebi_slab_decode(EBI_SLAB_DECODE_SWAR, sm->masks, sm->num_masks, ref);
+
+		for (uint32_t d = 1; d < EBI_SLAB_DECODE_COUNT; d++) {
+			if (!ebi_slab_decoder_supported((ebi_slab_decoder)d)) continue;
+			uint8_t out[EBI_SLAB_MAX_SLOTS];
+			size_t count = ebi_slab_decode((ebi_slab_decoder)d, sm->masks, sm->num_masks, out);
+			if (count != ref_count || memcmp(out, ref, count) != 0) {
+				printf("MISMATCH: %s sample %u\n", decoder_names[d], s);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static double bench(ebi_slab_decoder decoder, const sample *samples, uint32_t iterations)
+{
+	uint8_t out[EBI_SLAB_MAX_SLOTS];
+	volatile size_t sink = 0;
+
+	uint64_t begin = now_ns();
+	for (uint32_t it = 0; it < iterations; it++) {
+		for (uint32_t s = 0; s < NUM_SAMPLES; s++) {
+			const sample *sm = &samples[s];
+			sink += ebi_slab_decode(decoder, sm->masks, sm->num_masks, out);
+		}
+	}
+	uint64_t elapsed = now_ns() - begin;
+
+	(void)sink;
+	return (double)elapsed / ((double)iterations * NUM_SAMPLES);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t iterations = argc > 1 ? (uint32_t)atoi(argv[1]) : 200;
+
+	for (uint32_t d = 0; d < EBI_SLAB_DECODE_COUNT; d++) {
+		printf("%-12s %s\n", decoder_names[d],
+			ebi_slab_decoder_supported((ebi_slab_decoder)d) ? "supported" : "not supported");
+	}
+	printf("\n");
+
+	static sample samples[NUM_SAMPLES];
+	uint64_t rng = 0x9e3779b97f4a7c15ull;
+	const uint32_t densities[] = { 1, 10, 25, 50, 75, 90, 100 };
+	const uint32_t slab_counts[] = { 128, 63, 15, 7 };
+
+	bool ok = true;
+	for (uint32_t ci = 0; ci < sizeof(slab_counts) / sizeof(*slab_counts); ci++) {
+		uint32_t slab_count = slab_counts[ci];
+		printf("%3u slots  ", slab_count);
+		for (uint32_t d = 0; d < EBI_SLAB_DECODE_COUNT; d++) {
+			printf("%14s", decoder_names[d]);
+		}
+		printf("\n");
+
+		for (uint32_t di = 0; di < sizeof(densities) / sizeof(*densities); di++) {
+			make_samples(samples, slab_count, densities[di], &rng);
+			ok &= verify(samples);
+
+			printf("  %3u%% free", densities[di]);
+			for (uint32_t d = 0; d < EBI_SLAB_DECODE_COUNT; d++) {
+				if (ebi_slab_decoder_supported((ebi_slab_decoder)d)) {
+					printf("%11.2f ns", bench((ebi_slab_decoder)d, samples, iterations));
+				} else {
+					printf("%14s", "-");
+				}
+			}
+			printf("\n");
+		}
+	}
+
+	printf("\n%s\n", ok ? "All decoders match" : "Decoders DIFFER");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,151 @@
+// Cost of `ebi_assign_ref()` between collections and during marking.
+//
+// Overwrites random references of a set of nodes with `et->gc_marking` off
+// and on, the marking barrier is the one that all stores used to pay. Old
+// nodes are promoted to G first, young ones stay in N. Fresh nodes are
+// allocated during the run and have their references set a few times, which
+// skips the deletion barrier while marking. Nothing is collected, all
+// objects are already marked so only the barriers themselves are measured.
+// The core is compiled into this file to switch the barrier directly.
+//
+//   cc -O2 -pthread sketch/write_barrier_main.c src/ebi_heap.c src/ebi_sync.c src/ebi_os.c -o write_barrier
+//   ./write_barrier [log2_nodes] [log2_stores]
+
+#define _GNU_SOURCE
+
+#include "../src/ebi_core.c"
+
+#include <stdio.h>
+#include <time.h>
+
+#define NUM_EDGES 4
+#define FRESH_STORES 3
+
+typedef struct node node;
+struct node {
+	node *edges[NUM_EDGES];
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t rng_next(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return (uint32_t)(x >> 32);
+}
+
+static ebi_type *make_node_type()
+{
+	ebi_type *ref = (ebi_type*)calloc(1, sizeof(ebi_type));
+	ref->flags = EBI_TYPE_IS_REF;
+	ref->data_size = sizeof(void*);
+
+	ebi_type *type = (ebi_type*)calloc(1, sizeof(ebi_type) + NUM_EDGES * sizeof(ebi_field));
+	type->flags = EBI_TYPE_HAS_REFS;
+	type->data_size = sizeof(node);
+	type->num_fields = NUM_EDGES;
+	for (uint32_t i = 0; i < NUM_EDGES; i++) {
+		type->fields[i].type = ref;
+		type->fields[i].offset = (uint32_t)(i * sizeof(node*));
+		type->fields[i].flags = EBI_FIELD_IS_REF;
+	}
+	ebi_init_type(type);
+	return type;
+}
+
+static node **make_nodes(ebi_thread *et, ebi_type *type, size_t num_nodes, bool old)
+{
+	node **nodes = (node**)malloc(num_nodes * sizeof(node*));
+	for (size_t i = 0; i < num_nodes; i++) {
+		nodes[i] = (node*)ebi_new(et, type);
+	}
+
+	// No collection runs while building so plain stores are fine
+	uint64_t rng = 0x9e3779b97f4a7c15ull;
+	for (size_t i = 0; i < num_nodes; i++) {
+		for (uint32_t j = 0; j < NUM_EDGES; j++) {
+			nodes[i]->edges[j] = nodes[rng_next(&rng) & (num_nodes - 1)];
+		}
+	}
+
+	if (old) {
+		for (size_t i = 0; i < num_nodes; i++) {
+			ebi_mark(et, nodes[i], true);
+		}
+		for (;;) {
+			if (ebi_gc_mark(et)) continue;
+			if (et->objs_mark->count == 0) break;
+			ebi_flush_marks(et);
+		}
+	}
+	return nodes;
+}
+
+static double run_update(ebi_thread *et, node **nodes, size_t num_nodes, size_t num_stores)
+{
+	uint64_t rng = 0x2545f4914f6cdd1dull;
+	uint64_t begin = now_ns();
+	for (size_t i = 0; i < num_stores; i++) {
+		uint32_t r = rng_next(&rng);
+		node *src = nodes[r & (num_nodes - 1)];
+		node *dst = nodes[(r >> 8) & (num_nodes - 1)];
+		ebi_assign_ref(et, src, (r >> 30) * sizeof(node*), dst);
+	}
+	ebi_flush_links(et);
+	return (double)(now_ns() - begin) / (double)num_stores;
+}
+
+static double run_fresh(ebi_thread *et, ebi_type *type, node **nodes, size_t num_nodes, size_t num_stores)
+{
+	uint64_t rng = 0x2545f4914f6cdd1dull;
+	size_t num_allocs = num_stores / (NUM_EDGES * FRESH_STORES);
+	uint64_t begin = now_ns();
+	for (size_t i = 0; i < num_allocs; i++) {
+		node *src = (node*)ebi_new(et, type);
+		for (uint32_t k = 0; k < FRESH_STORES; k++) {
+			for (uint32_t j = 0; j < NUM_EDGES; j++) {
+				node *dst = nodes[rng_next(&rng) & (num_nodes - 1)];
+				ebi_assign_ref(et, src, j * sizeof(node*), dst);
+			}
+		}
+	}
+	ebi_flush_links(et);
+	return (double)(now_ns() - begin) / (double)(num_allocs * NUM_EDGES * FRESH_STORES);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t log2_nodes = argc > 1 ? (uint32_t)atoi(argv[1]) : 16;
+	uint32_t log2_stores = argc > 2 ? (uint32_t)atoi(argv[2]) : 24;
+	size_t num_nodes = (size_t)1 << log2_nodes;
+	size_t num_stores = (size_t)1 << log2_stores;
+
+	ebi_vm *vm = ebi_make_vm();
+	ebi_thread *et = ebi_make_thread(vm);
+	ebi_type *type = make_node_type();
+
+	node **old_nodes = make_nodes(et, type, num_nodes, true);
+	node **young_nodes = make_nodes(et, type, num_nodes, false);
+
+	for (uint32_t marking = 0; marking <= 1; marking++) {
+		// Objects allocated so far are not fresh anymore
+		et->gc_marking = marking != 0;
+		ebi_heap_cache_age(&et->heap);
+
+		double old_ns = run_update(et, old_nodes, num_nodes, num_stores);
+		double young_ns = run_update(et, young_nodes, num_nodes, num_stores);
+		double fresh_ns = run_fresh(et, type, young_nodes, num_nodes, num_stores);
+		printf("%-7s %zu nodes: old %6.2f ns/store  young %6.2f ns/store  fresh %6.2f ns/store\n",
+			marking ? "marking" : "idle", num_nodes, old_ns, young_ns, fresh_ns);
+	}
+	return 0;
+}
@@ -1,173 +1,68 @@
 #include "ebi_core.h"
+#include "ebi_sync.h"
+#include "ebi_intrin.h"
+#include "ebi_heap.h"
+#include "ebi_os.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 
-#include <intrin.h>
-#include <Windows.h>
-
-// -- OS abstraction
-
-// Platform
-
-// Intrinsics
-
-bool ebi_dcas(uintptr_t *dst, uintptr_t *cmp, uintptr_t lo, uintptr_t hi)
-{
-#if defined(_M_X64)
-	return (bool)_InterlockedCompareExchange128((volatile long long*)dst,
-		(long long)hi, (long long) lo, (long long*)cmp);
-#else
-	long long r = (long long)cmp[1] << 32 | (long long)cmp[0];
-	long long v = _InterlockedCompareExchange64((volatile long long*)dst,
-		(long long)hi << 32 | (long long)lo, r);
-	cmp[0] = (uintptr_t)r;
-	cmp[1] = (uintptr_t)(r >> 32);
-	return r == v;
-#endif
-}
-
-// -- Synchronization
-
-// Intrusive atomic stack
-
-typedef struct ebi_ia_stack {
-	uintptr_t v[2];
-} ebi_ia_stack;
-
-void ebi_ia_push(ebi_ia_stack *s, void *ptr)
-{
-	ebi_ia_stack r = *s;
-	do {
-		*(void**)ptr = (void*)r.v[0];
-	} while (!ebi_dcas(s->v, r.v, (uintptr_t)ptr, r.v[1] + 1));
-}
-
-void ebi_ia_push_all(ebi_ia_stack *s, void *ptr)
-{
-	ebi_ia_stack r = *s;
-	do {
-		ebi_assert(r.v[0] == 0);
-	} while (!ebi_dcas(s->v, r.v, (uintptr_t)ptr, r.v[1] + 1));
-}
-
-void *ebi_ia_pop(ebi_ia_stack *s)
-{
-	ebi_ia_stack r = *s;
-	void **head;
-	do {
-		head = (void**)r.v[0];
-		if (!head) return NULL;
-	} while (!ebi_dcas(s->v, r.v, (uintptr_t)*head, r.v[1] + 1));
-	*head = NULL;
-	return head;
-}
-
-bool ebi_ia_maybe_nonempty(ebi_ia_stack *s)
-{
-	return s->v[0] != 0;
-}
-
-void *ebi_ia_pop_all(ebi_ia_stack *s)
-{
-	ebi_ia_stack r = *s;
-	void **head;
-	do {
-		head = (void**)r.v[0];
-	} while (!ebi_dcas(s->v, r.v, 0, r.v[1] + 1));
-	return head;
-}
-
-uintptr_t ebi_ia_get_count(ebi_ia_stack *s)
-{
-	return (uintptr_t)_InterlockedExchangeAdd((volatile long*)&s->v[1], 0);
-}
-
-// Mutex
-
-// TODO: Implement this internally
-#pragma comment(lib, "Synchronization.lib")
-
-typedef struct ebi_mutex {
-	uint32_t lock;
-	uint32_t waiters;
-} ebi_mutex;
-
-void ebi_mutex_lock(ebi_mutex *m)
-{
-	uint32_t cmp = 1;
-	uint32_t spin = 0;
-	for (;;) {
-		if (!_interlockedbittestandset((volatile long*)&m->lock, 0)) break;
-		if (++spin > 1000) {
-			_InterlockedIncrement((volatile long*)&m->waiters);
-			WaitOnAddress(&m->lock, &cmp, 4, INFINITE);
-			_InterlockedDecrement((volatile long*)&m->waiters);
-		}
-	}
-}
-
-bool ebi_mutex_try_lock(ebi_mutex *m)
-{
-	return !_interlockedbittestandset((volatile long*)&m->lock, 0);
-}
+// Utility
 
-void ebi_mutex_unlock(ebi_mutex *m)
+static ebi_forceinline size_t ebi_grow_sz(size_t size, size_t min)
 {
-	_InterlockedExchange((volatile long*)&m->lock, 0);
-	if (m->waiters > 0) {
-		WakeByAddressSingle(&m->lock);
-	}
+	return size >= min ? size * 2 : min;
 }
 
-// Event
-
-// TODO: Implement this internally
+// -- Core
 
-typedef struct ebi_fence {
-	uint32_t lock;
-} ebi_fence;
+#define EBI_OBJLIST_SIZE 64
+#define EBI_MAX_DEFER_LINKS 64
 
-void ebi_fence_close(ebi_fence *e)
-{
-	_InterlockedExchange((volatile long*)&e->lock, 1);
-}
+// References found while marking wait in a ring of this many entries before
+// they are marked so their memory can be prefetched, 0 disables it. Must be
+// a power of two.
+#ifndef EBI_MARK_PREFETCH
+#define EBI_MARK_PREFETCH 16
+#endif
 
-void ebi_fence_open(ebi_fence *e)
-{
-	_InterlockedExchange((volatile long*)&e->lock, 0);
-	WakeByAddressAll(&e->lock);
-}
+// Objects to look ahead in a mark list
+#define EBI_MARK_LIST_PREFETCH 4
 
-void ebi_fence_wait(ebi_fence *e)
-{
-	uint32_t cmp = 0;
-	uint32_t spin = 0;
-	for (;;) {
-		if (_InterlockedExchangeAdd((volatile long*)&e->lock, 0) == 0) break;
-		if (++spin > 1000) {
-			WaitOnAddress(&e->lock, &cmp, 4, INFINITE);
-		}
-	}
-}
+// Suffix arrays are marked in ranges of this many elements, the ones after
+// the first are queued as separate tasks so other threads can steal them
+#ifndef EBI_MARK_RANGE_SIZE
+#define EBI_MARK_RANGE_SIZE 4096
+#endif
 
-// Utility
+// Remember G->N references in slab cards instead of promoting the N objects
+// to G, see `ebi_gc_mark_cards()`. 0 promotes them eagerly.
+#ifndef EBI_GC_CARD_MARKING
+#define EBI_GC_CARD_MARKING 1
+#endif
 
-static ebi_forceinline size_t ebi_grow_sz(size_t size, size_t min)
-{
-	return size > min ? size * 2 : min;
-}
+// Slabs are split into `EBI_GC_CARDS` cards of `1 << EBI_GC_CARD_SHIFT` bytes,
+// one bit each in `slab->cards`. Spans scale their cards to cover the object.
+#define EBI_GC_CARDS 32
+#define EBI_GC_CARD_SHIFT 9
 
-// -- Core
+// Allocation a thread can do in a collection before it has to assist
+#define EBI_GC_ASSIST_HEADROOM (256*1024)
 
-#define EBI_OBJLIST_SIZE 64
-#define EBI_MAX_DEFER_LINKS 64
+// Allocation paid for by traversing a mark list or sweeping a chunk
+#define EBI_GC_ASSIST_MARK_CREDIT (16*1024)
+#define EBI_GC_ASSIST_SWEEP_CREDIT (EBI_HEAP_SWEEP_CHUNK * EBI_HEAP_SLAB_SIZE / 4)
 
 typedef struct ebi_obj ebi_obj;
 typedef struct ebi_gc_gen ebi_gc_gen;
 typedef struct ebi_pool ebi_pool;
 typedef struct ebi_objlist ebi_objlist;
 typedef struct ebi_objlink ebi_objlink;
+typedef struct ebi_alloc_profile ebi_alloc_profile;
+typedef struct ebi_alloc_profile_entry ebi_alloc_profile_entry;
+typedef struct ebi_weak_entry ebi_weak_entry;
+typedef struct ebi_thread_set ebi_thread_set;
 
 // Shared allocation for small similarly-sized objects
 struct ebi_pool {
@@ -184,27 +79,41 @@ struct ebi_pool {
 // reference value `vm->gen`. In addition we have two sets: G and N. Objects in
 // G are only traversed/collected during major collcetions while N are always.
 //
-// Pointers from G to N are not allowed at the end of the mark phase, this is
-// enfored by promoting N objects (recursively) to G when pointed to from G.
+// Pointers from G to N are remembered by dirtying the card of the slab they
+// are stored in and minor collections mark through the dirty cards, so the
+// N objects can still be collected once nothing points to them. Major
+// collections trace everything and promote them, see `ebi_gc_mark_cards()`.
 //
 // We use two separate byte-sized variables so we can assign to them without
 // atomic operations. This is safe since even though we _do_ have race
 // conditions, all threads try to write the same values: `vm->gen.g/n`.
 // If `gen.g != 0` then `gen.n` is ignored!
+//
+// The generations of objects are not stored in the objects but in the
+// `gen_g` and `gen_n` side arrays of the slab containing them. Both counters
+// skip zero so `g == 0 && n == 0` can mean that the slot is free, which lets
+// sweeping compare whole slabs at once, see `ebi_slab_find_dead()`.
 struct ebi_gc_gen {
 	uint8_t g, n;
 };
 
-// Heap object header
+// Heap object header. Everything else the GC needs to know about an object
+// is stored in its slab, see `ebi_heap_get_slab()`.
 struct ebi_obj {
 	ebi_type *type;
-	uint32_t weak_slot;
-	uint16_t pool_offset;
-	ebi_gc_gen gen;
 	char data[];
 };
 
-// List of objects that can be sent between threads
+// Weak slot of an object, only objects that have had weak references made
+// to them have an entry in `vm->weak_table`.
+struct ebi_weak_entry {
+	ebi_obj *obj;
+	uint32_t slot;
+};
+
+// List of objects that can be sent between threads. Entries with the low
+// bit set are range tasks that take two entries: the tagged object and the
+// index of the suffix range to mark, see `ebi_queue_range()`.
 struct ebi_objlist {
 
 	// Intrusive atomic `ebi_ia_list` link
@@ -214,80 +123,148 @@ struct ebi_objlist {
 	uint32_t count;
 };
 
+// Threads that marking steals from without taking `vm->thread_mutex`. Threads
+// are only ever appended: `num` is published with a release store after the
+// entry is written and a full set is replaced by a larger copy. Sets are
+// never freed as stealing threads may still be reading an old one.
+struct ebi_thread_set {
+	ebi_thread_set *retired; // Smaller set this one replaced
+	uint32_t num, capacity;
+	ebi_thread *threads[EBI_FLEXIBLE_ARRAY];
+};
+
 // Link between two heap objects, for example `src.prop = dst`.
 struct ebi_objlink {
 	void *src, *dst;
+	size_t offset; // Of the reference in `src`
 };
 
-typedef enum ebi_alive_group {
-	EBI_ALIVE_G,  // G objects, swept on major GC
-	EBI_ALIVE_N1, // old N objects, swept on minor GC
-	EBI_ALIVE_N2, // new N objects, not swept
+// Allocation count of objects of `type` with `size` bytes including the header
+struct ebi_alloc_profile_entry {
+	ebi_type *type;
+	uint32_t size;
+	uint64_t count;
+};
 
-	EBI_NUM_ALIVE_GROUPS,
-} ebi_alive_group;
+// Open addressing hash table of allocation counts. Only the owner thread
+// modifies it and `mutex` is taken only when inserting new entries so that
+// `ebi_dump_alloc_profile()` can read it safely.
+struct ebi_alloc_profile {
+	ebi_mutex mutex;
+	ebi_alloc_profile_entry *entries;
+	uint32_t count, capacity;
+};
 
 typedef enum ebi_gc_stage {
-	EBI_GC_IDLE,
-	EBI_GC_MARK,
-	EBI_GC_SWEEP,
+	EBI_GC_IDLE,      // Not collecting
+	EBI_GC_START,     // Waiting for threads to switch to the new generation
+	EBI_GC_MARK,      // Marking objects
+	EBI_GC_MARK_SYNC, // Waiting for threads to flush marks to finish marking
+	EBI_GC_SWEEP,     // Sweeping unmarked objects
+	EBI_GC_EVACUATE,  // Waiting to stop all threads to move objects
 } ebi_gc_stage;
 
 struct ebi_thread {
 	ebi_vm *vm;
 
 	// Monotonically increased value, the thread will synchronize with others
-	// at `ebi_checkpoint()` if `et->checkpoint != vm->checkpoint`.
-	// If `checkpoint_fence` is set all threads will stop and wait.
+	// at `ebi_checkpoint()` if `et->checkpoint != vm->checkpoint`. Storing
+	// `vm->checkpoint` here acknowledges a GC handshake.
 	uint32_t checkpoint;
 
 	// Current GC generation, a local copy of `vm->gen`.
 	ebi_gc_gen gen;
 
+	// Local copy of `vm->gc_marking`, picks the write barrier to use in
+	// `ebi_assign_ref()`.
+	bool gc_marking;
+
 	// Mutex used to take ownership of this thread. Used eg. for scanning
 	// stacks of halted threads.
 	ebi_mutex mutex;
 	bool lock_by_gc;
 
 	ebi_objlist *objs_mark; // List of marked objects to traverse
-	ebi_objlist *objs_alive[EBI_NUM_ALIVE_GROUPS]; // Alive objects per group
+
+	// Full mark lists waiting to be traversed, other threads steal from here.
+	ebi_ws_deque mark_deque;
+	uint32_t steal_index; // Where to start looking for work to steal
+
+#if EBI_MARK_PREFETCH
+	// References waiting to be marked, see `ebi_mark_prefetch()`. Entries
+	// are data pointers with `to_g` in the low bit, zero if unused.
+	uintptr_t mark_ring[EBI_MARK_PREFETCH];
+	uint32_t mark_ring_pos;
+#endif
 
 	// Deferred batched object to object links to process.
 	ebi_objlink defer_links[EBI_MAX_DEFER_LINKS];
 	size_t num_defer_links;
+
+	// Thread local slab allocator
+	ebi_heap_cache heap;
+
+	// Allocation debt: once `heap.alloc_bytes` passes `assist_limit` during
+	// a collection the thread has to help with it, see `ebi_gc_assist()`.
+	uint64_t assist_limit;
+
+	// Allocation size histogram if `vm->alloc_profile` is enabled
+	ebi_alloc_profile alloc_profile;
 };
 
 struct ebi_vm {
 	// Hot data
 	uint32_t checkpoint;
-	bool checkpoint_fence;
 	ebi_gc_gen gen;
-	uint8_t pad[9];
+	bool alloc_profile;
+	bool gc_marking; // Mark phase barriers needed, changed with a handshake
+	uint8_t pad[8];
 
 	// Object lists
-	ebi_ia_stack objs_mark;
-	ebi_ia_stack objs_sweep;
-	ebi_ia_stack objs_sweep_next;
-	ebi_ia_stack objs_alive[EBI_NUM_ALIVE_GROUPS];
+	ebi_ia_stack objs_mark; // Overflow from full `et->mark_deque`
 	ebi_ia_stack objs_reuse;
 
 	// Threads
 	ebi_mutex thread_mutex;
-	ebi_fence thread_fence;
-	ebi_fence thread_sync_fence;
 	ebi_thread **threads;
 	size_t num_threads;
 	size_t max_threads;
+	ebi_thread_set *thread_set; // Same threads for lock-free readers
+
+	// Slab manager
+	ebi_heap heap;
+
+	// Open addressing hash table from objects to weak slots, objects with
+	// an entry have their bit set in `slab->weak_mask`.
+	ebi_mutex weak_mutex;
+	ebi_weak_entry *weak_table;
+	uint32_t weak_count, weak_capacity;
 
 	// GC state
 	ebi_mutex gc_mutex;
 	ebi_gc_stage gc_stage;
 	bool gc_major;
+	uint32_t gc_checkpoint;  // Handshake we're waiting for
+	uintptr_t gc_mark_count; // Mark push count when finishing marking
+	ebi_slab *gc_evacuate;   // Slabs to evacuate, see `ebi_gc_evacuate()`
+	uint32_t gc_evacuate_attempts;
+
+	// Slabs with dirty cards, see `ebi_gc_dirty_cards()`
+	ebi_mutex card_mutex;
+	ebi_slab **card_slabs;
+	size_t num_card_slabs, max_card_slabs;
+
+	// Pacing, see `ebi_gc_finish()`
+	uint32_t gc_growth_percent;
+	size_t gc_min_trigger;
+	uint32_t gc_minor_cycles;   // Minor collections since the last major one
+	size_t gc_live_bytes;       // Estimated live bytes after the last cycle
+	size_t gc_major_live_bytes; // Estimated live bytes after the last major cycle
 };
 
 
 #if EBI_DEBUG
-ebi_forceinline ebi_obj *ebi_get_obj(void *inst)
+static ebi_forceinline ebi_obj *ebi_get_obj(void *inst)
 {
 	ebi_assert(inst);
 	ebi_obj *obj = (ebi_obj*)inst - 1;
@@ -298,6 +275,12 @@ ebi_forceinline ebi_obj *ebi_get_obj(void *inst)
 	#define ebi_get_obj(inst) ((ebi_obj*)(inst) - 1)
 #endif
 
+static ebi_forceinline uint8_t ebi_get_gen_g(ebi_obj *obj)
+{
+	ebi_slab *slab = ebi_heap_get_slab(obj);
+	return slab->gen_g[ebi_slab_get_slot(slab, obj)];
+}
+
 // Allocate a new empty object list.
 ebi_objlist *ebi_alloc_objlist(ebi_vm *vm)
 {
@@ -316,24 +299,16 @@ ebi_objlist *ebi_flush_marks(ebi_thread *et)
 {
 	ebi_vm *vm = et->vm;
 	if (et->objs_mark->count > 0) {
-		ebi_ia_push(&vm->objs_mark, et->objs_mark);
+		if (!ebi_ws_push(&et->mark_deque, et->objs_mark)) {
+			ebi_ia_push(&vm->objs_mark, et->objs_mark);
+		}
 		et->objs_mark = ebi_alloc_objlist(vm);
 	}
 	return et->objs_mark;
 }
 
-ebi_objlist *ebi_flush_alive(ebi_thread *et, ebi_alive_group group)
-{
-	ebi_vm *vm = et->vm;
-	if (et->objs_alive[group]->count > 0) {
-		ebi_ia_push(&vm->objs_alive[group], et->objs_alive[group]);
-		et->objs_alive[group] = ebi_alloc_objlist(vm);
-	}
-	return et->objs_alive[group];
-}
-
 // If the object type has references push it to the to-mark list.
-ebi_forceinline void ebi_queue_mark(ebi_thread *et, ebi_obj *obj)
+static ebi_forceinline void ebi_queue_mark(ebi_thread *et, ebi_obj *obj)
 {
 	if (obj->type->flags & EBI_TYPE_HAS_REFS) {
 		ebi_objlist *list = et->objs_mark;
@@ -344,84 +319,466 @@ ebi_forceinline void ebi_queue_mark(ebi_thread *et, ebi_obj *obj)
 	}
 }
 
+// Queue range `range` of the suffix array of `obj` to be marked.
+static ebi_forceinline void ebi_queue_range(ebi_thread *et, ebi_obj *obj, uint32_t range)
+{
+	ebi_objlist *list = et->objs_mark;
+	if (list->count + 2 > EBI_OBJLIST_SIZE) {
+		list = ebi_flush_marks(et);
+	}
+	list->objs[list->count++] = (ebi_obj*)((uintptr_t)obj | 1);
+	list->objs[list->count++] = (ebi_obj*)(uintptr_t)range;
+}
+
 // Mark `ptr`, promote the object to G if `to_g == true`.
-ebi_forceinline void ebi_mark(ebi_thread *et, void *ptr, bool to_g)
+static ebi_forceinline void ebi_mark(ebi_thread *et, void *ptr, bool to_g)
 {
 	ebi_obj *obj = ebi_get_obj(ptr);
+	ebi_slab *slab = ebi_heap_get_slab(obj);
+	uint32_t slot = ebi_slab_get_slot(slab, obj);
 
 	// Update the active generation
-	if (obj->gen.g | to_g) {
-		if (obj->gen.g == et->gen.g) return;
-		obj->gen.g = et->gen.g;
+	uint8_t *gen_g = &slab->gen_g[slot];
+	if (*gen_g | to_g) {
+		if (*gen_g == et->gen.g) return;
+		*gen_g = et->gen.g;
 	} else {
-		if (obj->gen.n == et->gen.n) return;
-		obj->gen.n = et->gen.n;
+		uint8_t *gen_n = &slab->gen_n[slot];
+		if (*gen_n == et->gen.n) return;
+		*gen_n = et->gen.n;
 	}
 	ebi_queue_mark(et, obj);
 }
 
-ebi_forceinline void ebi_add_alive(ebi_thread *et, ebi_obj *obj, ebi_alive_group group)
+// Mark `ptr` a few references later. Marking a large heap is mostly waiting
+// for cache misses: the slab header, generation bytes and object header of
+// each reference are prefetched in stages as the reference moves through
+// `et->mark_ring` so the misses overlap. Call `ebi_mark_drain()` before
+// anyone could expect the marks to be done.
+static ebi_forceinline void ebi_mark_prefetch(ebi_thread *et, void *ptr, bool to_g)
+{
+#if EBI_MARK_PREFETCH
+	ebi_slab *slab = ebi_heap_get_slab(ptr);
+	ebi_prefetch(slab);
+	ebi_prefetch((ebi_obj*)ptr - 1);
+
+	// The slab header of the reference halfway through the ring should be
+	// in cache by now, fetch its generations
+	uint32_t pos = et->mark_ring_pos;
+	uintptr_t mid = et->mark_ring[(pos + EBI_MARK_PREFETCH / 2) % EBI_MARK_PREFETCH];
+	if (mid) {
+		ebi_slab *mid_slab = ebi_heap_get_slab((void*)mid);
+		uint32_t slot = ebi_slab_get_slot(mid_slab, (ebi_obj*)(mid & ~(uintptr_t)1) - 1);
+		ebi_prefetch(&mid_slab->gen_g[slot]);
+		ebi_prefetch(&mid_slab->gen_n[slot]);
+	}
+
+	uintptr_t prev = et->mark_ring[pos];
+	et->mark_ring[pos] = (uintptr_t)ptr | (uintptr_t)to_g;
+	et->mark_ring_pos = (pos + 1) % EBI_MARK_PREFETCH;
+	if (prev) {
+		ebi_mark(et, (void*)(prev & ~(uintptr_t)1), (prev & 1) != 0);
+	}
+#else
+	ebi_mark(et, ptr, to_g);
+#endif
+}
+
+// Mark everything waiting in `et->mark_ring`.
+static void ebi_mark_drain(ebi_thread *et)
 {
-	ebi_objlist *list = et->objs_alive[group];
-	if (list->count == EBI_OBJLIST_SIZE) {
-		list = ebi_flush_alive(et, group);
+#if EBI_MARK_PREFETCH
+	uint32_t pos = et->mark_ring_pos;
+	for (uint32_t i = 0; i < EBI_MARK_PREFETCH; i++) {
+		uintptr_t *entry = &et->mark_ring[(pos + i) % EBI_MARK_PREFETCH];
+		if (*entry) {
+			ebi_mark(et, (void*)(*entry & ~(uintptr_t)1), (*entry & 1) != 0);
+			*entry = 0;
+		}
 	}
-	list->objs[list->count++] = obj;
+#else
+	(void)et;
+#endif
 }
 
 void ebi_mark_fields(ebi_thread *et, void *ptr, ebi_type *type, bool to_g);
 
+// Mark the reference stored at `ptr` if it's not NULL.
+static ebi_forceinline void ebi_mark_slot(ebi_thread *et, char *ptr, bool to_g)
+{
+	void *value = *(void**)ptr;
+	if (value) {
+		ebi_mark_prefetch(et, value, to_g);
+	}
+}
+
+// Mark the references of a `type` at `ptr` using its flattened map, see
+// `ebi_init_type()`. Returns `false` if the type doesn't have one.
+static ebi_forceinline bool ebi_mark_refs(ebi_thread *et, char *ptr, ebi_type *type, bool to_g)
+{
+	switch (type->mark) {
+	case EBI_TYPE_MARK_ONE_REF:
+		ebi_mark_slot(et, ptr + type->ref_offset, to_g);
+		return true;
+	case EBI_TYPE_MARK_ALL_REFS: {
+		uint32_t num = type->num_refs;
+		for (uint32_t i = 0; i < num; i++) {
+			ebi_mark_slot(et, ptr + i * sizeof(void*), to_g);
+		}
+	} return true;
+	case EBI_TYPE_MARK_BITMAP: {
+		uint64_t bits = type->ref_bitmap;
+		while (bits) {
+			ebi_mark_slot(et, ptr + ebi_bsf64(bits) * sizeof(void*), to_g);
+			bits &= bits - 1;
+		}
+	} return true;
+	case EBI_TYPE_MARK_OFFSETS: {
+		const uint32_t *offsets = type->ref_offsets;
+		uint32_t num = type->num_refs;
+		for (uint32_t i = 0; i < num; i++) {
+			ebi_mark_slot(et, ptr + offsets[i], to_g);
+		}
+	} return true;
+	default:
+		return false;
+	}
+}
+
 // Mark a complex object of `type` located at `ptr`.
-ebi_forceinline void ebi_mark_type(ebi_thread *et, void *ptr, ebi_type *type, bool to_g)
+static ebi_forceinline void ebi_mark_type(ebi_thread *et, void *ptr, ebi_type *type, bool to_g)
 {
 	uint32_t flags = type->flags;
 	if (flags & EBI_TYPE_IS_REF) {
 		void *value = *(void**)ptr;
 		if (value) {
-			ebi_mark(et, value, to_g);
+			ebi_mark_prefetch(et, value, to_g);
 		}
 	} else if (flags & EBI_TYPE_HAS_REFS) {
 		ebi_mark_fields(et, ptr, type, to_g);
 	}
 }
 
-// Mark fields of a `type` at `ptr`.
+// Mark `suf_num` suffix array elements of `suf_type` at `suf_ptr`.
+static void ebi_mark_suffix(ebi_thread *et, char *suf_ptr, ebi_type *suf_type, size_t suf_num, bool to_g)
+{
+	size_t suf_stride = suf_type->data_size;
+
+	// Optimized suffix marking as arrays tend to be larger than structs, pick
+	// the shape once instead of per element
+	if (suf_type->flags & EBI_TYPE_IS_REF) {
+		while (suf_num > 0) {
+			ebi_mark_slot(et, suf_ptr, to_g);
+			suf_num--;
+			suf_ptr += suf_stride;
+		}
+	} else if (suf_type->mark == EBI_TYPE_MARK_ONE_REF) {
+		suf_ptr += suf_type->ref_offset;
+		while (suf_num > 0) {
+			ebi_mark_slot(et, suf_ptr, to_g);
+			suf_num--;
+			suf_ptr += suf_stride;
+		}
+	} else if (suf_type->mark == EBI_TYPE_MARK_ALL_REFS) {
+		uint32_t num_refs = suf_type->num_refs;
+		while (suf_num > 0) {
+			for (uint32_t i = 0; i < num_refs; i++) {
+				ebi_mark_slot(et, suf_ptr + i * sizeof(void*), to_g);
+			}
+			suf_num--;
+			suf_ptr += suf_stride;
+		}
+	} else if (suf_type->mark != EBI_TYPE_MARK_FIELDS) {
+		while (suf_num > 0) {
+			ebi_mark_refs(et, suf_ptr, suf_type, to_g);
+			suf_num--;
+			suf_ptr += suf_stride;
+		}
+	} else if (suf_type->flags & EBI_TYPE_HAS_REFS) {
+		while (suf_num > 0) {
+			ebi_mark_fields(et, suf_ptr, suf_type, to_g);
+			suf_num--;
+			suf_ptr += suf_stride;
+		}
+	}
+}
+
+// Mark fields of a `type` at `ptr`. References are queued through
+// `ebi_mark_prefetch()`, call `ebi_mark_drain()` afterwards.
 void ebi_mark_fields(ebi_thread *et, void *ptr, ebi_type *type, bool to_g)
 {
 	ebi_assert(type->flags & EBI_TYPE_HAS_REFS);
 
+	// Walking the fields still works but is slower, call `ebi_init_type()`
+	ebi_assert(type->mark != EBI_TYPE_MARK_FIELDS);
+
 	char *inst_ptr = (char*)ptr;
 	size_t num_fields = type->num_fields;
 
 	ebi_field *begin = type->fields, *end = begin + num_fields;
-	for (ebi_field *f = begin; f != end; f++) {
-		ebi_mark_type(et, inst_ptr + f->offset, f->type, to_g);
+	if (!ebi_mark_refs(et, inst_ptr, type, to_g)) {
+		for (ebi_field *f = begin; f != end; f++) {
+			ebi_mark_type(et, inst_ptr + f->offset, f->type, to_g);
+		}
 	}
 
 	if (type->flags & EBI_TYPE_HAS_SUFFIX) {
 		ebi_type *suf_type = end->type;
-		size_t suf_stride = suf_type->data_size, suf_num = *(uint32_t*)inst_ptr;
-		char *suf_ptr = inst_ptr + type->data_size;
-
-		// Optimized suffix marking as arrays tend to be larger than structs
-		// TODO: Optimization for `EBI_TYPE_HAS_ONE_REF` ?
-		if (suf_type->flags & EBI_TYPE_IS_REF) {
-			while (suf_num > 0) {
-				void *value = *(void**)suf_ptr;
-				if (value) {
-					ebi_mark(et, value, to_g);
-				}
-				suf_num--;
-				suf_ptr += suf_stride;
+		size_t suf_num = *(uint32_t*)inst_ptr;
+
+		// Queue the ranges after the first one of large arrays. Only objects
+		// have suffixes so `ptr` is the object data.
+		if (suf_num > EBI_MARK_RANGE_SIZE && (suf_type->flags & (EBI_TYPE_IS_REF | EBI_TYPE_HAS_REFS))) {
+			ebi_obj *obj = ebi_get_obj(ptr);
+			uint32_t num_ranges = (uint32_t)((suf_num + EBI_MARK_RANGE_SIZE - 1) / EBI_MARK_RANGE_SIZE);
+			for (uint32_t range = 1; range < num_ranges; range++) {
+				ebi_queue_range(et, obj, range);
+			}
+			suf_num = EBI_MARK_RANGE_SIZE;
+		}
+
+		ebi_mark_suffix(et, inst_ptr + type->data_size, suf_type, suf_num, to_g);
+	}
+}
+
+// Mark a range of the suffix array of `obj` queued by `ebi_mark_fields()`.
+static void ebi_mark_range(ebi_thread *et, ebi_obj *obj, uint32_t range)
+{
+	ebi_type *type = obj->type;
+	ebi_type *suf_type = type->fields[type->num_fields].type;
+	size_t suf_num = *(uint32_t*)obj->data;
+	size_t begin = (size_t)range * EBI_MARK_RANGE_SIZE;
+	size_t num = suf_num - begin < EBI_MARK_RANGE_SIZE ? suf_num - begin : EBI_MARK_RANGE_SIZE;
+	char *suf_ptr = obj->data + type->data_size + begin * suf_type->data_size;
+	ebi_mark_suffix(et, suf_ptr, suf_type, num, ebi_get_gen_g(obj) != 0);
+}
+
+// Collect the offsets of references in `type` and nested value types to
+// `offsets` if not NULL, returns the number of them.
+static uint32_t ebi_collect_refs(ebi_type *type, uint32_t base, uint32_t *offsets, uint32_t num)
+{
+	ebi_field *begin = type->fields, *end = begin + type->num_fields;
+	for (ebi_field *f = begin; f != end; f++) {
+		uint32_t flags = f->type->flags;
+		if (flags & EBI_TYPE_IS_REF) {
+			if (offsets) offsets[num] = base + f->offset;
+			num++;
+		} else if (flags & EBI_TYPE_HAS_REFS) {
+			num = ebi_collect_refs(f->type, base + f->offset, offsets, num);
+		}
+	}
+	return num;
+}
+
+void ebi_init_type(ebi_type *type)
+{
+	if ((type->flags & EBI_TYPE_IS_REF) || !(type->flags & EBI_TYPE_HAS_REFS)) return;
+	if (type->mark != EBI_TYPE_MARK_FIELDS) return;
+
+	if (type->flags & EBI_TYPE_HAS_SUFFIX) {
+		ebi_init_type(type->fields[type->num_fields].type);
+	}
+
+	uint32_t num = ebi_collect_refs(type, 0, NULL, 0);
+	uint32_t *offsets = (uint32_t*)malloc((num ? num : 1) * sizeof(uint32_t));
+	ebi_assert(offsets);
+	ebi_collect_refs(type, 0, offsets, 0);
+
+	// Pick the most specific shape, the generic fallback is a list of offsets
+	bool all_refs = true, fits_bitmap = true;
+	uint64_t bitmap = 0;
+	for (uint32_t i = 0; i < num; i++) {
+		uint32_t offset = offsets[i];
+		if (offset != i * sizeof(void*)) all_refs = false;
+		if (offset % sizeof(void*) != 0 || offset / sizeof(void*) >= 64) {
+			fits_bitmap = false;
+		} else {
+			bitmap |= (uint64_t)1 << (offset / sizeof(void*));
+		}
+	}
+
+	type->num_refs = num;
+	type->ref_offset = num ? offsets[0] : 0;
+	type->ref_bitmap = bitmap;
+	if (num == 1) {
+		type->mark = EBI_TYPE_MARK_ONE_REF;
+	} else if (all_refs) {
+		type->mark = EBI_TYPE_MARK_ALL_REFS;
+	} else if (fits_bitmap) {
+		type->mark = EBI_TYPE_MARK_BITMAP;
+	} else {
+		type->ref_offsets = offsets;
+		type->mark = EBI_TYPE_MARK_OFFSETS;
+		return;
+	}
+	free(offsets);
+}
+
+// -- Remembered set
+
+ebi_static_assert(gc_cards, (EBI_HEAP_SLAB_SIZE >> EBI_GC_CARD_SHIFT) == EBI_GC_CARDS);
+
+// Cards of spans are as large as needed for `EBI_GC_CARDS` to cover the object.
+static ebi_forceinline uint32_t ebi_gc_card_shift(ebi_slab *slab)
+{
+	uint32_t shift = EBI_GC_CARD_SHIFT;
+	if (slab->cls == EBI_SLAB_SPAN) {
+		size_t size = ((ebi_span*)slab->data)->size;
+		while ((size - 1) >> shift >= EBI_GC_CARDS) shift++;
+	}
+	return shift;
+}
+
+// Bits of the cards of `slab` overlapping `[begin, end)`.
+static ebi_forceinline uint32_t ebi_gc_card_bits(ebi_slab *slab, const void *begin, const void *end)
+{
+	uint32_t shift = ebi_gc_card_shift(slab);
+	size_t first = (size_t)((const char*)begin - (const char*)slab) >> shift;
+	size_t last = (size_t)((const char*)end - 1 - (const char*)slab) >> shift;
+	return (uint32_t)((2ull << last) - (1ull << first));
+}
+
+// Dirty `cards` of `slab`, the first dirty card adds the slab to
+// `vm->card_slabs`. Cards are only cleared at the start of major collections
+// or when the slab is reused so a slab with dirty cards is always listed.
+static void ebi_gc_dirty_cards(ebi_vm *vm, ebi_slab *slab, uint32_t cards)
+{
+	if ((ebi_atomic_load32_relaxed(&slab->cards) & cards) == cards) return;
+	if (ebi_atomic_or32(&slab->cards, cards) != 0) return;
+
+	ebi_mutex_lock(&vm->card_mutex);
+	if (vm->num_card_slabs == vm->max_card_slabs) {
+		vm->max_card_slabs = ebi_grow_sz(vm->max_card_slabs, 64);
+		vm->card_slabs = (ebi_slab**)realloc(vm->card_slabs, vm->max_card_slabs * sizeof(ebi_slab*));
+		ebi_assert(vm->card_slabs);
+	}
+	vm->card_slabs[vm->num_card_slabs++] = slab;
+	ebi_mutex_unlock(&vm->card_mutex);
+}
+
+// Mark through the G objects overlapping dirty `cards` of a slab.
+static void ebi_gc_mark_slab_cards(ebi_thread *et, ebi_slab *slab, uint32_t cards)
+{
+	uint32_t stride = slab->stride;
+	uint32_t slab_count = ebi_heap_classes[slab->cls].slab_count;
+	uint32_t next = 0; // Objects before this are done already
+	while (cards) {
+		size_t begin = (size_t)ebi_bsf32(cards) << EBI_GC_CARD_SHIFT;
+		size_t end = begin + ((size_t)1 << EBI_GC_CARD_SHIFT);
+		cards &= cards - 1;
+
+		// The first card is mostly the slab header
+		if (end <= EBI_SLAB_HEADER_SIZE) continue;
+		uint32_t first = begin > EBI_SLAB_HEADER_SIZE ? (uint32_t)((begin - EBI_SLAB_HEADER_SIZE) / stride) : 0;
+		uint32_t last = (uint32_t)((end - EBI_SLAB_HEADER_SIZE + stride - 1) / stride);
+		if (first < next) first = next;
+		if (last > slab_count) last = slab_count;
+
+		for (uint32_t slot = first; slot < last; slot++) {
+			if (!slab->gen_g[slot]) continue;
+			ebi_obj *obj = (ebi_obj*)(slab->data + slot * stride);
+			if (obj->type->flags & EBI_TYPE_HAS_REFS) {
+				ebi_mark_fields(et, obj->data, obj->type, false);
 			}
-		} else if (suf_type->flags & EBI_TYPE_HAS_REFS) {
-			while (suf_num > 0) {
-				ebi_mark_fields(et, suf_ptr, suf_type, to_g);
-				suf_num--;
-				suf_ptr += suf_stride;
+		}
+		if (last > next) next = last;
+	}
+}
+
+// Mark through the parts of a G span object overlapping dirty `cards`, only
+// the suffix elements in them for arrays.
+static void ebi_gc_mark_span_cards(ebi_thread *et, ebi_slab *slab, uint32_t cards)
+{
+	if (!slab->gen_g[0]) return;
+	ebi_obj *obj = (ebi_obj*)((ebi_span*)slab->data + 1);
+	ebi_type *type = obj->type;
+	if (!(type->flags & EBI_TYPE_HAS_REFS)) return;
+	if (!(type->flags & EBI_TYPE_HAS_SUFFIX)) {
+		ebi_mark_fields(et, obj->data, type, false);
+		return;
+	}
+
+	char *suf_ptr = obj->data + type->data_size;
+	if (cards & ebi_gc_card_bits(slab, obj, suf_ptr)) {
+		if (!ebi_mark_refs(et, obj->data, type, false)) {
+			for (uint32_t i = 0; i < type->num_fields; i++) {
+				ebi_field *f = &type->fields[i];
+				ebi_mark_type(et, obj->data + f->offset, f->type, false);
 			}
 		}
 	}
+
+	ebi_type *suf_type = type->fields[type->num_fields].type;
+	if (!(suf_type->flags & (EBI_TYPE_IS_REF | EBI_TYPE_HAS_REFS))) return;
+	size_t suf_num = *(uint32_t*)obj->data;
+	size_t suf_stride = suf_type->data_size;
+	size_t base = (size_t)(suf_ptr - (char*)slab);
+	uint32_t shift = ebi_gc_card_shift(slab);
+	size_t next = 0; // Elements before this are done already
+	while (cards) {
+		size_t begin = (size_t)ebi_bsf32(cards) << shift;
+		size_t end = begin + ((size_t)1 << shift);
+		cards &= cards - 1;
+
+		if (end <= base) continue;
+		size_t first = begin > base ? (begin - base) / suf_stride : 0;
+		size_t last = (end - base + suf_stride - 1) / suf_stride;
+		if (first < next) first = next;
+		if (last > suf_num) last = suf_num;
+		if (first < last) {
+			ebi_mark_suffix(et, suf_ptr + first * suf_stride, suf_type, last - first, false);
+			next = last;
+		}
+	}
+}
+
+// Minor collections don't traverse G objects so the references from G to N
+// in dirty cards are marked as roots. The cards stay dirty until the next
+// major collection as the references are likely still there.
+// Call with `vm->gc_mutex` held after the start handshake.
+static void ebi_gc_mark_cards(ebi_thread *et)
+{
+	ebi_vm *vm = et->vm;
+
+	// Pairs with the fence in `ebi_flush_links()`: either we see the new
+	// references here or they are marked when flushed
+	ebi_atomic_fence_seq_cst();
+
+	ebi_mutex_lock(&vm->card_mutex);
+	size_t num_kept = 0;
+	for (size_t i = 0; i < vm->num_card_slabs; i++) {
+		ebi_slab *slab = vm->card_slabs[i];
+
+		// Emptied slabs clear their cards when reused
+		uint32_t state = ebi_atomic_load32_relaxed(&slab->state);
+		if (state == EBI_SLAB_UNUSED || state == EBI_SLAB_EMPTY) continue;
+		vm->card_slabs[num_kept++] = slab;
+
+		uint32_t cards = ebi_atomic_load32_relaxed(&slab->cards);
+		if (slab->cls == EBI_SLAB_SPAN) {
+			ebi_gc_mark_span_cards(et, slab, cards);
+		} else {
+			ebi_gc_mark_slab_cards(et, slab, cards);
+		}
+	}
+	vm->num_card_slabs = num_kept;
+	ebi_mutex_unlock(&vm->card_mutex);
+
+	ebi_mark_drain(et);
+}
+
+// Forget the dirty cards at the start of a major collection: it traces all
+// live G objects and promotes what they point to. References stored after
+// this dirty the cards again.
+// Call with `vm->gc_mutex` held before posting the start handshake.
+static void ebi_gc_clear_cards(ebi_vm *vm)
+{
+	ebi_mutex_lock(&vm->card_mutex);
+	for (size_t i = 0; i < vm->num_card_slabs; i++) {
+		ebi_atomic_xhg32(&vm->card_slabs[i]->cards, 0);
+	}
+	vm->num_card_slabs = 0;
+	ebi_mutex_unlock(&vm->card_mutex);
 }
 
 // Flush deferred object links
@@ -429,13 +786,31 @@ void ebi_flush_links(ebi_thread *et)
 {
 	size_t num = et->num_defer_links;
 	if (!num) return;
+	et->num_defer_links = 0;
 
-	// TODO: Memory barrier here
+	// The slot stores must be visible before we read the generations: GC
+	// threads mark objects and then scan their fields so either they see the
+	// new values or we see the mark. This is a store-load ordering so it needs
+	// a full fence, pairs with the fence in `ebi_gc_mark()`.
+	ebi_atomic_fence_seq_cst();
 
 	for (size_t i = 0; i < num; i++) {
 		ebi_objlink link = et->defer_links[i];
-		uint32_t src_g = ebi_get_obj(link.src)->gen.g;
-		uint32_t dst_g = ebi_get_obj(link.dst)->gen.g;
+		ebi_obj *src = ebi_get_obj(link.src);
+		uint32_t src_g = ebi_get_gen_g(src);
+		uint32_t dst_g = ebi_get_gen_g(ebi_get_obj(link.dst));
+
+#if EBI_GC_CARD_MARKING
+		// Remember `G->N` links instead of promoting, `dst` only needs a
+		// mark if the link was made during marking.
+		if (src_g && !dst_g) {
+			ebi_slab *slab = ebi_heap_get_slab(src);
+			char *ref = (char*)link.src + link.offset;
+			ebi_gc_dirty_cards(et->vm, slab, ebi_gc_card_bits(slab, ref, ref + sizeof(void*)));
+			if (et->gc_marking) ebi_mark(et, link.dst, false);
+			continue;
+		}
+#endif
 
 		// Promote `dst` to G for `N->G` and `G->N` links. Note that this will
 		// also "promote" `dst` if both are in G with different genrations.
@@ -444,7 +819,7 @@ void ebi_flush_links(ebi_thread *et)
 }
 
 // Defer an object link mark
-ebi_forceinline void ebi_defer_link(ebi_thread *et, void *src, void *dst)
+static ebi_forceinline void ebi_defer_link(ebi_thread *et, void *src, size_t offset, void *dst)
 {
 	if (et->num_defer_links == EBI_MAX_DEFER_LINKS) {
 		ebi_flush_links(et);
@@ -452,6 +827,7 @@ ebi_forceinline void ebi_defer_link(ebi_thread *et, void *src, void *dst)
 	ebi_objlink *link = &et->defer_links[et->num_defer_links++];
 	link->src = src;
 	link->dst = dst;
+	link->offset = offset;
 }
 
 // Assign reference at `inst + offset` to `value`. Issue write barriers to
@@ -460,110 +836,523 @@ void ebi_assign_ref(ebi_thread *et, void *inst, size_t offset, void *value)
 {
 	void **slot = (void**)((char*)inst + offset);
 
-	// Always issue an Yuasa deletion barrier for the previous value
+	// Outside of marking live objects are already marked with the current
+	// generation so only links from G to N objects can do anything. Only
+	// look at `src`, which we are writing to anyway, and leave checking `dst`
+	// to `ebi_flush_links()` instead of touching its slab here. With cards
+	// nothing is promoted while we are not marking so `src` can't move to G
+	// under us, promoting links can and are checked after the fence.
+	if (!et->gc_marking) {
+		*slot = value;
+#if EBI_GC_CARD_MARKING
+		if (value && ebi_get_gen_g(ebi_get_obj(inst))) {
+			ebi_defer_link(et, inst, offset, value);
+		}
+#else
+		if (value && !ebi_get_gen_g(ebi_get_obj(value))) {
+			ebi_defer_link(et, inst, offset, value);
+		}
+#endif
+		return;
+	}
+
+	// Yuasa deletion barrier for the previous value. Objects allocated
+	// after the handshake were not there when marking started so anything
+	// they point to has gone through the barrier below already.
 	void *prev = *slot;
-	if (prev) {
+	if (prev && !ebi_heap_cache_is_fresh(&et->heap, ebi_heap_get_slab(inst))) {
 		ebi_mark(et, prev, false);
 	}
 
 	// Defer other barriers to reduce the amount of memory fences
-	ebi_defer_link(et, inst, value);
+	if (value) {
+		ebi_defer_link(et, inst, offset, value);
+	}
 
 	*slot = (void*)value;
 }
 
+// Current `vm->thread_set`, pairs with the release fence in `ebi_make_thread()`.
+static ebi_forceinline ebi_thread_set *ebi_get_thread_set(ebi_vm *vm)
+{
+	ebi_thread_set *set = *(ebi_thread_set *volatile*)&vm->thread_set;
+	ebi_atomic_fence_acquire();
+	return set;
+}
+
+// Try to steal a mark list from another thread.
+ebi_objlist *ebi_gc_steal(ebi_thread *et)
+{
+	ebi_thread_set *set = ebi_get_thread_set(et->vm);
+	uint32_t num = ebi_atomic_load32_acquire(&set->num);
+	for (uint32_t i = 0; i < num; i++) {
+		uint32_t ix = (et->steal_index + i) % num;
+		ebi_thread *ot = set->threads[ix];
+		if (ot == et) continue;
+		ebi_objlist *list = (ebi_objlist*)ebi_ws_steal(&ot->mark_deque);
+		if (list) {
+			// Keep stealing from the same victim while it has work
+			et->steal_index = ix;
+			return list;
+		}
+	}
+	return NULL;
+}
+
+// Check if there is any pending mark work in the VM and count the number of
+// mark lists ever pushed to `*p_count`. New work can only appear by pushing
+// so if all threads have flushed their marks and the count stays the same
+// marking is complete.
+bool ebi_gc_mark_pending(ebi_vm *vm, uintptr_t *p_count)
+{
+	bool pending = ebi_ia_maybe_nonempty(&vm->objs_mark);
+	uintptr_t count = ebi_ia_get_count(&vm->objs_mark);
+
+	ebi_thread_set *set = ebi_get_thread_set(vm);
+	uint32_t num = ebi_atomic_load32_acquire(&set->num);
+	for (uint32_t i = 0; i < num; i++) {
+		ebi_thread *ot = set->threads[i];
+		count += ebi_ws_get_pushes(&ot->mark_deque);
+		pending |= ebi_ws_maybe_nonempty(&ot->mark_deque);
+	}
+
+	*p_count = count;
+	return pending;
+}
+
 // Advance the mark phase of GC.
 // Returns `true` if there was something to mark.
 bool ebi_gc_mark(ebi_thread *et)
 {
 	ebi_vm *vm = et->vm;
-	ebi_objlist *list = ebi_ia_pop(&vm->objs_mark);
+
+	// Prefer our own recent work, then overflow and finally other threads
+	ebi_objlist *list = (ebi_objlist*)ebi_ws_pop(&et->mark_deque);
+	if (!list) list = ebi_ia_pop(&vm->objs_mark);
+	if (!list) list = ebi_gc_steal(et);
 	if (!list) return false;
 
+	// Make sure the marks of the objects are visible before reading their
+	// fields, pairs with the fence in `ebi_flush_links()`.
+	ebi_atomic_fence_seq_cst();
+
 	// Objects only end up in this list if `EBI_TYPE_HAS_REFS` so we can safely
-	// call `ebi_mark_fields()` directly wihtout a check.
+	// call `ebi_mark_fields()` directly wihtout a check. The list was filled
+	// a while ago so fetch the objects a few iterations ahead, prefetching
+	// the index entry of a range task is harmless.
 	uint32_t count = list->count;
 	for (uint32_t oi = 0; oi < count; oi++) {
+		if (oi + EBI_MARK_LIST_PREFETCH < count) {
+			ebi_prefetch(list->objs[oi + EBI_MARK_LIST_PREFETCH]);
+		}
 		ebi_obj *obj = list->objs[oi];
-		ebi_mark_fields(et, obj->data, obj->type, obj->gen.g != 0);
+		if ((uintptr_t)obj & 1) {
+			uint32_t range = (uint32_t)(uintptr_t)list->objs[++oi];
+			ebi_mark_range(et, (ebi_obj*)((uintptr_t)obj & ~(uintptr_t)1), range);
+			continue;
+		}
+
+		// Push the child of single reference objects such as list nodes
+		// directly, they don't have enough work to amortize the call
+		ebi_type *type = obj->type;
+		bool to_g = ebi_get_gen_g(obj) != 0;
+		if (type->mark == EBI_TYPE_MARK_ONE_REF && !(type->flags & EBI_TYPE_HAS_SUFFIX)) {
+			ebi_mark_slot(et, obj->data + type->ref_offset, to_g);
+			continue;
+		}
+		ebi_mark_fields(et, obj->data, type, to_g);
 	}
+	ebi_mark_drain(et);
 
 	ebi_ia_push(&vm->objs_reuse, list);
 	return true;
 }
 
-ebi_forceinline bool ebi_alive(ebi_gc_gen cur, ebi_gc_gen gen)
+// -- Weak table
+
+static ebi_forceinline uint32_t ebi_weak_hash(ebi_obj *obj)
 {
-	uint32_t dg = ((uint32_t)gen.g - (uint32_t)cur.g) & 0xff;
-	uint32_t dn = ((uint32_t)gen.n - (uint32_t)cur.n) & 0xff;
-	return (dg < 128) | ((gen.g == 0) & (dn < 128));
+	uint32_t h = (uint32_t)((uintptr_t)obj >> 3) * 0x9e3779b9u;
+	return h ^ (h >> 16);
 }
 
-void ebi_free_obj(ebi_thread *et, ebi_obj *obj)
+// Returns the weak slot of `obj` or zero if it doesn't have one.
+// Call with `vm->weak_mutex` held.
+uint32_t ebi_weak_table_find(ebi_vm *vm, ebi_obj *obj)
 {
-#if 0
-	if (obj->weak_slot) {
-		// TODO: Batch these?
-		ebi_mutex_lock(&vm->weak_mutex);
-		ebi_weak_slot *slot = &vm->weak_slots[obj->weak_slot];
-		if (slot->gen != UINT32_MAX) {
-			slot->val.next_free = vm->weak_free_head;
-			vm->weak_free_head = obj->weak_slot;
-			slot->gen++;
+	if (!vm->weak_capacity) return 0;
+	uint32_t mask = vm->weak_capacity - 1;
+	for (uint32_t ix = ebi_weak_hash(obj) & mask; ; ix = (ix + 1) & mask) {
+		ebi_weak_entry *e = &vm->weak_table[ix];
+		if (e->obj == obj) return e->slot;
+		if (!e->obj) return 0;
+	}
+}
+
+// Associate weak slot `slot` with `obj` which must not have one yet.
+// Call with `vm->weak_mutex` held.
+void ebi_weak_table_insert(ebi_vm *vm, ebi_obj *obj, uint32_t slot)
+{
+	if ((vm->weak_count + 1) * 2 > vm->weak_capacity) {
+		ebi_weak_entry *old = vm->weak_table;
+		uint32_t old_capacity = vm->weak_capacity;
+		vm->weak_capacity = (uint32_t)ebi_grow_sz(old_capacity, 64);
+		vm->weak_table = (ebi_weak_entry*)calloc(vm->weak_capacity, sizeof(ebi_weak_entry));
+		ebi_assert(vm->weak_table);
+
+		uint32_t mask = vm->weak_capacity - 1;
+		for (uint32_t i = 0; i < old_capacity; i++) {
+			if (!old[i].obj) continue;
+			uint32_t ix = ebi_weak_hash(old[i].obj) & mask;
+			while (vm->weak_table[ix].obj) ix = (ix + 1) & mask;
+			vm->weak_table[ix] = old[i];
 		}
-		ebi_mutex_unlock(&vm->weak_mutex);
+		free(old);
 	}
-#endif
 
-	free(obj);
+	uint32_t mask = vm->weak_capacity - 1;
+	uint32_t ix = ebi_weak_hash(obj) & mask;
+	while (vm->weak_table[ix].obj) ix = (ix + 1) & mask;
+	vm->weak_table[ix].obj = obj;
+	vm->weak_table[ix].slot = slot;
+	vm->weak_count++;
+
+	ebi_slab *slab = ebi_heap_get_slab(obj);
+	uint32_t bit = ebi_slab_get_slot(slab, obj);
+	ebi_atomic_or32(&slab->weak_mask[bit / 32], 1u << (bit % 32));
 }
 
-// Advance the sweep phase of GC.
-// Returns `true` if there was something to sweep.
+// Remove the entry of `obj` and return its weak slot.
+// Call with `vm->weak_mutex` held.
+uint32_t ebi_weak_table_remove(ebi_vm *vm, ebi_obj *obj)
+{
+	if (!vm->weak_capacity) return 0;
+	uint32_t mask = vm->weak_capacity - 1;
+	uint32_t ix = ebi_weak_hash(obj) & mask;
+	while (vm->weak_table[ix].obj != obj) {
+		if (!vm->weak_table[ix].obj) return 0;
+		ix = (ix + 1) & mask;
+	}
+	uint32_t slot = vm->weak_table[ix].slot;
+
+	// Shift back following entries that would not be found past the hole
+	for (uint32_t next = (ix + 1) & mask; vm->weak_table[next].obj; next = (next + 1) & mask) {
+		uint32_t home = ebi_weak_hash(vm->weak_table[next].obj) & mask;
+		if (((next - home) & mask) >= ((next - ix) & mask)) {
+			vm->weak_table[ix] = vm->weak_table[next];
+			ix = next;
+		}
+	}
+	vm->weak_table[ix].obj = NULL;
+	vm->weak_count--;
+
+	ebi_slab *slab = ebi_heap_get_slab(obj);
+	uint32_t bit = ebi_slab_get_slot(slab, obj);
+	ebi_atomic_and32(&slab->weak_mask[bit / 32], ~(1u << (bit % 32)));
+	return slot;
+}
+
+// Remove the weak table entries of the `dead[]` slots of a small object slab.
+static void ebi_sweep_weak(ebi_vm *vm, ebi_slab *slab, const uint32_t *dead)
+{
+	uint32_t num_masks = slab->num_masks;
+	for (uint32_t mi = 0; mi < num_masks; mi++) {
+		if (slab->weak_mask[mi] & dead[mi]) break;
+		if (mi + 1 == num_masks) return;
+	}
+
+	ebi_mutex_lock(&vm->weak_mutex);
+	for (uint32_t mi = 0; mi < num_masks; mi++) {
+		uint32_t mask = slab->weak_mask[mi] & dead[mi];
+		while (mask) {
+			uint32_t slot = mi * 32 + ebi_bsf32(mask);
+			ebi_obj *obj = (ebi_obj*)(slab->data + slot * slab->stride);
+			uint32_t weak_slot = ebi_weak_table_remove(vm, obj);
+			(void)weak_slot;
+			mask &= mask - 1;
+		}
+	}
+	ebi_mutex_unlock(&vm->weak_mutex);
+}
+
+// Sweep the large object spans, there are few of them so they are done as a
+// single chunk.
+static void ebi_gc_sweep_spans(ebi_thread *et)
+{
+	ebi_vm *vm = et->vm;
+	ebi_heap *heap = &vm->heap;
+	ebi_mutex_lock(&heap->span_mutex);
+	for (ebi_span *span = heap->live_spans; span; span = span->live_next) {
+		ebi_slab *slab = ebi_heap_get_slab(span);
+		uint32_t dead[1];
+		if (!ebi_slab_find_dead(slab, et->gen.g, et->gen.n, dead)) continue;
+		if (slab->weak_mask[0] & 1) {
+			ebi_mutex_lock(&vm->weak_mutex);
+			ebi_weak_table_remove(vm, (ebi_obj*)(span + 1));
+			ebi_mutex_unlock(&vm->weak_mutex);
+		}
+		slab->gen_g[0] = 0;
+		slab->gen_n[0] = 0;
+		ebi_heap_free_big(heap, slab);
+	}
+	ebi_mutex_unlock(&heap->span_mutex);
+}
+
+// Advance the sweep phase of GC by one chunk of slabs.
+// Returns `true` if there was something to sweep.
 bool ebi_gc_sweep(ebi_thread *et)
 {
 	ebi_vm *vm = et->vm;
-	ebi_objlist *list = ebi_ia_pop(&vm->objs_sweep);
-	if (!list) {
-		if (ebi_ia_maybe_nonempty(&vm->objs_sweep_next)) {
-			list = ebi_ia_pop_all(&vm->objs_sweep_next);
-			if (list) {
-				ebi_ia_push_all(&vm->objs_sweep, list);
-				if (list->next) {
-					ebi_ia_push_all(&vm->objs_sweep_next, list->next);
-				}
-			}
+	ebi_heap_sweep_chunk chunk;
+	if (!ebi_heap_sweep_claim(&vm->heap, &chunk)) return false;
+
+	if (chunk.spans) {
+		ebi_gc_sweep_spans(et);
+	}
+
+	for (char *ptr = chunk.begin; ptr != chunk.end; ptr += EBI_HEAP_SLAB_SIZE) {
+		ebi_slab *slab = (ebi_slab*)ptr;
+		uint32_t state = ebi_atomic_load32_relaxed(&slab->state);
+		if (state == EBI_SLAB_UNUSED || state == EBI_SLAB_EMPTY) continue;
+		if (!ebi_heap_sweep_claim_slab(&vm->heap, slab)) continue;
+
+		uint32_t dead[EBI_SLAB_MAX_MASKS];
+		if (!ebi_slab_find_dead(slab, et->gen.g, et->gen.n, dead)) continue;
+		ebi_sweep_weak(vm, slab, dead);
+		ebi_heap_free_slots(&vm->heap, slab, dead);
+	}
+
+	ebi_heap_sweep_finish(&vm->heap);
+	return true;
+}
+
+// -- Allocation profiling
+
+static ebi_forceinline uint32_t ebi_alloc_profile_hash(ebi_type *type, uint32_t size)
+{
+	uint32_t h = (uint32_t)((uintptr_t)type >> 4) ^ (size * 0x9e3779b9u);
+	return h ^ (h >> 16);
+}
+
+static ebi_alloc_profile_entry *ebi_alloc_profile_find(ebi_alloc_profile *p, ebi_type *type, uint32_t size)
+{
+	if (!p->capacity) return NULL;
+	uint32_t mask = p->capacity - 1;
+	uint32_t ix = ebi_alloc_profile_hash(type, size) & mask;
+	for (;;) {
+		ebi_alloc_profile_entry *e = &p->entries[ix];
+		if (e->type == type && e->size == size) return e;
+		if (!e->type) return NULL;
+		ix = (ix + 1) & mask;
+	}
+}
+
+// Insert a new entry, call with `p->mutex` held.
+static ebi_alloc_profile_entry *ebi_alloc_profile_insert(ebi_alloc_profile *p, ebi_type *type, uint32_t size)
+{
+	if ((p->count + 1) * 4 > p->capacity * 3) {
+		uint32_t old_capacity = p->capacity;
+		ebi_alloc_profile_entry *old_entries = p->entries;
+
+		p->capacity = (uint32_t)ebi_grow_sz(p->capacity, 64);
+		p->entries = (ebi_alloc_profile_entry*)calloc(p->capacity, sizeof(ebi_alloc_profile_entry));
+		ebi_assert(p->entries);
+
+		uint32_t mask = p->capacity - 1;
+		for (uint32_t i = 0; i < old_capacity; i++) {
+			ebi_alloc_profile_entry *e = &old_entries[i];
+			if (!e->type) continue;
+			uint32_t ix = ebi_alloc_profile_hash(e->type, e->size) & mask;
+			while (p->entries[ix].type) ix = (ix + 1) & mask;
+			p->entries[ix] = *e;
 		}
-		if (!list) return false;
+		free(old_entries);
 	}
 
-	ebi_gc_gen gen = et->gen;
+	uint32_t mask = p->capacity - 1;
+	uint32_t ix = ebi_alloc_profile_hash(type, size) & mask;
+	while (p->entries[ix].type) ix = (ix + 1) & mask;
 
-	uint32_t count = list->count;
-	for (uint32_t oi = 0; oi < count; oi++) {
-		ebi_obj *obj = list->objs[oi];
-		if (ebi_alive(gen, obj->gen)) {
-			ebi_add_alive(et, obj, obj->gen.g ? EBI_ALIVE_G : EBI_ALIVE_N1);
+	ebi_alloc_profile_entry *e = &p->entries[ix];
+	e->type = type;
+	e->size = size;
+	e->count = 0;
+	p->count++;
+	return e;
+}
+
+static ebi_noinline void ebi_profile_alloc(ebi_thread *et, ebi_type *type, size_t size)
+{
+	ebi_alloc_profile *p = &et->alloc_profile;
+	uint32_t size32 = size < UINT32_MAX ? (uint32_t)size : UINT32_MAX;
+	ebi_alloc_profile_entry *e = ebi_alloc_profile_find(p, type, size32);
+	if (!e) {
+		ebi_mutex_lock(&p->mutex);
+		e = ebi_alloc_profile_insert(p, type, size32);
+		ebi_mutex_unlock(&p->mutex);
+	}
+
+	// Racy with `ebi_dump_alloc_profile()` but the counts are only statistics
+	*(volatile uint64_t*)&e->count = e->count + 1;
+}
+
+// Enable or disable recording allocation sizes for `ebi_dump_alloc_profile()`.
+void ebi_set_alloc_profile(ebi_vm *vm, bool enabled)
+{
+	*(volatile bool*)&vm->alloc_profile = enabled;
+}
+
+// Write the allocation size histogram of all threads to `path`. Each line
+// contains the allocation size in bytes (including the object header), the
+// number of allocations and the type name. Consumed by misc/make_heap_sizes.py.
+bool ebi_dump_alloc_profile(ebi_vm *vm, const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) return false;
+
+	// Merge the threads into a single table
+	ebi_alloc_profile merged = { 0 };
+	ebi_mutex_lock(&vm->thread_mutex);
+	for (uint32_t i = 0; i < vm->num_threads; i++) {
+		ebi_alloc_profile *p = &vm->threads[i]->alloc_profile;
+		ebi_mutex_lock(&p->mutex);
+		for (uint32_t j = 0; j < p->capacity; j++) {
+			ebi_alloc_profile_entry *e = &p->entries[j];
+			if (!e->type) continue;
+			ebi_alloc_profile_entry *m = ebi_alloc_profile_find(&merged, e->type, e->size);
+			if (!m) m = ebi_alloc_profile_insert(&merged, e->type, e->size);
+			m->count += *(volatile uint64_t*)&e->count;
+		}
+		ebi_mutex_unlock(&p->mutex);
+	}
+	ebi_mutex_unlock(&vm->thread_mutex);
+
+	fprintf(f, "# ebi allocation profile: size count type\n");
+	for (uint32_t i = 0; i < merged.capacity; i++) {
+		ebi_alloc_profile_entry *e = &merged.entries[i];
+		if (!e->type) continue;
+		fprintf(f, "%u %llu ", e->size, (unsigned long long)e->count);
+		ebi_symbol *name = e->type->info ? e->type->info->name : NULL;
+		if (name) {
+			fprintf(f, "%.*s\n", (int)name->length, name->data);
 		} else {
-			ebi_free_obj(et, obj);
+			fprintf(f, "<%p>\n", (void*)e->type);
 		}
 	}
+	free(merged.entries);
 
-	ebi_ia_push(&vm->objs_reuse, list);
-	return true;
+	bool ok = ferror(f) == 0;
+	return (fclose(f) == 0) && ok;
+}
+
+// -- Heap statistics
+
+ebi_static_assert(heap_stats_classes, EBI_HEAP_CLASSES <= EBI_HEAP_STATS_MAX_CLASSES);
+
+// Fill `stats` from the slab headers and thread caches without stopping the
+// world. Slots sitting in thread caches are counted as free.
+void ebi_get_heap_stats(ebi_vm *vm, ebi_heap_stats *stats)
+{
+	ebi_heap_get_stats(&vm->heap, stats);
+
+	ebi_mutex_lock(&vm->thread_mutex);
+	for (uint32_t i = 0; i < vm->num_threads; i++) {
+		ebi_heap_cache *c = &vm->threads[i]->heap;
+		for (uint32_t cls = 0; cls < EBI_HEAP_CLASSES; cls++) {
+			ebi_heap_class_cache *cc = &c->classes[cls];
+			uint32_t ix = *(volatile uint32_t*)&cc->ix;
+			uint32_t count = *(volatile uint32_t*)&cc->count;
+			if (ix >= count) continue;
+
+			ebi_heap_class_stats *cs = &stats->classes[cls];
+			size_t num_cached = count - ix;
+			if (num_cached > cs->live_slots) num_cached = cs->live_slots;
+			cs->live_slots -= num_cached;
+			cs->free_slots += num_cached;
+		}
+	}
+	ebi_mutex_unlock(&vm->thread_mutex);
+
+	// Slabs only touch the pages their slots cover, so measure fragmentation
+	// against slot capacity instead of `slab_bytes`.
+	size_t slot_bytes = 0;
+	stats->live_bytes = 0;
+	for (uint32_t cls = 0; cls < stats->num_classes; cls++) {
+		ebi_heap_class_stats *cs = &stats->classes[cls];
+		stats->live_bytes += cs->live_slots * cs->slot_size;
+		slot_bytes += (cs->live_slots + cs->free_slots) * cs->slot_size;
+	}
+
+	stats->fragmentation = 0.0;
+	if (slot_bytes > 0) {
+		stats->fragmentation = 1.0 - (double)stats->live_bytes / (double)slot_bytes;
+	}
+}
+
+void ebi_set_heap_scavenge(ebi_vm *vm, size_t reserve_bytes, uint32_t idle_cycles)
+{
+	// The scavenger runs as part of `ebi_gc_step()`
+	ebi_mutex_lock(&vm->gc_mutex);
+	vm->heap.scavenge_reserve = reserve_bytes / EBI_HEAP_SLAB_SIZE;
+	vm->heap.scavenge_cycles = idle_cycles;
+	ebi_mutex_unlock(&vm->gc_mutex);
 }
 
+void ebi_set_heap_evacuation(ebi_vm *vm, double max_occupancy, size_t max_bytes)
+{
+	ebi_mutex_lock(&vm->gc_mutex);
+	vm->heap.evacuate_occupancy = max_occupancy;
+	vm->heap.evacuate_bytes = max_bytes;
+	ebi_mutex_unlock(&vm->gc_mutex);
+}
+
+void ebi_set_gc_pacing(ebi_vm *vm, uint32_t growth_percent, size_t min_trigger_bytes)
+{
+	ebi_mutex_lock(&vm->gc_mutex);
+	vm->gc_growth_percent = growth_percent;
+	vm->gc_min_trigger = min_trigger_bytes;
+	ebi_mutex_unlock(&vm->gc_mutex);
+}
+
+void ebi_set_heap_huge_pages(ebi_vm *vm, bool enabled)
+{
+	ebi_mutex_lock(&vm->heap.reserve_mutex);
+	vm->heap.huge_pages = enabled;
+	ebi_mutex_unlock(&vm->heap.reserve_mutex);
+}
+
+void ebi_set_heap_lazy_sweep(ebi_vm *vm, bool enabled)
+{
+	// Read without locking in `ebi_heap_alloc_slow()`, safe to change in the
+	// middle of a sweep as slabs are claimed either way
+	ebi_mutex_lock(&vm->gc_mutex);
+	vm->heap.lazy_sweep = enabled;
+	ebi_mutex_unlock(&vm->gc_mutex);
+}
+
+// -- Object allocation
+
 ebi_obj *ebi_alloc_obj(ebi_thread *et, ebi_type *type, size_t size)
 {
-	ebi_obj *obj = (ebi_obj*)malloc(sizeof(ebi_obj) + size);
+	if (et->vm->alloc_profile) {
+		ebi_profile_alloc(et, type, sizeof(ebi_obj) + size);
+	}
+
+	// Only changes on refills so this is well predicted. Assisting may pass
+	// a checkpoint and move to the next generation so it must be done before
+	// the object is stamped with `et->gen`.
+	if (et->heap.alloc_bytes > et->assist_limit) {
+		ebi_gc_assist(et);
+	}
+
+	ebi_obj *obj = (ebi_obj*)ebi_heap_alloc(&et->heap, sizeof(ebi_obj) + size);
 	if (!obj) return NULL;
 
 	obj->type = type;
-	obj->weak_slot = 0;
-	obj->pool_offset = 0;
-	obj->gen.g = 0;
-	obj->gen.n = et->gen.n;
-	ebi_add_alive(et, obj, EBI_ALIVE_N2);
+	ebi_slab *slab = ebi_heap_get_slab(obj);
+	uint32_t slot = ebi_slab_get_slot(slab, obj);
+	slab->gen_g[slot] = 0;
+	slab->gen_n[slot] = et->gen.n;
 
 	return obj;
 }
@@ -574,96 +1363,452 @@ void *ebi_new(ebi_thread *et, ebi_type *type)
 	ebi_obj *obj = ebi_alloc_obj(et, type, size);
 	if (!obj) return NULL;
 
+	// Large objects are allocated from fresh zeroed pages
 	void *data = obj + 1;
-	memset(data, 0, size);
+	if (sizeof(ebi_obj) + size <= EBI_HEAP_MAX_CLASS_SIZE) memset(data, 0, size);
 	return data;
 }
 
-void ebi_synchronize_thread(ebi_thread *et, bool wait_marks)
+void *ebi_new_uninit(ebi_thread *et, ebi_type *type)
 {
-	ebi_vm *vm = et->vm;
-	if (et->checkpoint == vm->checkpoint) return;
+	size_t size = type->data_size;
+	ebi_obj *obj = ebi_alloc_obj(et, type, size);
+	if (!obj) return NULL;
 
-	for (uint32_t i = 0; i < EBI_NUM_ALIVE_GROUPS; i++) {
-		ebi_flush_alive(et, (ebi_alive_group)i);
-	}
+	void *data = obj + 1;
+	return data;
+}
 
-	do {
-		ebi_flush_links(et);
-		ebi_flush_marks(et);
-	} while (wait_marks && ebi_gc_mark(et));
+void *ebi_new_array(ebi_thread *et, ebi_type *type, size_t count)
+{
+	ebi_assert(type->elem_size);
+	size_t size = type->data_size + type->elem_size * count;
+	ebi_obj *obj = ebi_alloc_obj(et, type, size);
+	if (!obj) return NULL;
 
-	et->gen = vm->gen;
-	et->checkpoint = vm->checkpoint;
+	// Large objects are allocated from fresh zeroed pages
+	void *data = obj + 1;
+	if (sizeof(ebi_obj) + size <= EBI_HEAP_MAX_CLASS_SIZE) memset(data, 0, size);
+	*(size_t*)data = count;
+	return data;
 }
 
-void ebi_synchronize_thread_fence(ebi_thread *et)
+void *ebi_new_array_uninit(ebi_thread *et, ebi_type *type, size_t count)
+{
+	ebi_assert(type->elem_size);
+	size_t size = type->data_size + type->elem_size * count;
+	ebi_obj *obj = ebi_alloc_obj(et, type, size);
+	if (!obj) return NULL;
+
+	void *data = obj + 1;
+	*(size_t*)data = count;
+	return data;
+}
+
+// Flush all thread local state to the VM and acknowledge the current
+// checkpoint. Called either by the thread itself or by a GC thread that has
+// taken ownership of it via `et->mutex`.
+void ebi_synchronize_thread(ebi_thread *et)
 {
 	ebi_vm *vm = et->vm;
+	uint32_t checkpoint = ebi_atomic_load32_acquire(&vm->checkpoint);
+	if (et->checkpoint == checkpoint) return;
 
-	if (vm->checkpoint_fence) {
-		ebi_synchronize_thread(et, true);
-		ebi_mutex_unlock(&et->mutex);
-		ebi_fence_wait(&vm->thread_fence);
-		ebi_mutex_lock(&et->mutex);
-	} else {
-		ebi_synchronize_thread(et, false);
+	ebi_flush_links(et);
+	ebi_flush_marks(et);
+
+	et->gen = vm->gen;
+	et->gc_marking = vm->gc_marking;
+	ebi_heap_cache_age(&et->heap);
+
+	// Handshakes only happen during collections, start accruing debt
+	if (et->assist_limit == UINT64_MAX) {
+		et->assist_limit = et->heap.alloc_bytes + EBI_GC_ASSIST_HEADROOM;
 	}
+
+	// Acknowledge the handshake, the flushed lists and generation must be
+	// visible before, pairs with the acquire in `ebi_gc_handshake_done()`.
+	ebi_atomic_store32_release(&et->checkpoint, checkpoint);
 }
 
 void ebi_checkpoint(ebi_thread *et)
 {
 	ebi_vm *vm = et->vm;
-	if (et->checkpoint != vm->checkpoint) {
-		ebi_synchronize_thread_fence(et);
+	if (et->checkpoint != ebi_atomic_load32_acquire(&vm->checkpoint)) {
+		ebi_synchronize_thread(et);
 	}
 }
 
+// -- Evacuation
 
-void ebi_gc_thread_barrier(ebi_thread *et)
+// Major collections can move the live objects out of sparse slabs so that
+// they can be returned to the heap. Moving is done with all threads stopped:
+// the old copies are overwritten with tagged forwarding pointers and every
+// reference in the heap and in pending GC work is redirected. References
+// from outside the heap are not known to the GC, so objects that native code
+// holds on to must be pinned with `ebi_pin()`.
+
+// Give up if threads don't let go of their mutexes in this many GC steps
+#define EBI_GC_EVACUATE_ATTEMPTS 64
+
+void ebi_pin(ebi_thread *et, void *ptr)
+{
+	(void)et;
+	ebi_obj *obj = ebi_get_obj(ptr);
+	ebi_slab *slab = ebi_heap_get_slab(obj);
+	uint32_t slot = ebi_slab_get_slot(slab, obj);
+	ebi_atomic_or32(&slab->pin_mask[slot / 32], 1u << (slot % 32));
+}
+
+void ebi_unpin(ebi_thread *et, void *ptr)
+{
+	(void)et;
+	ebi_obj *obj = ebi_get_obj(ptr);
+	ebi_slab *slab = ebi_heap_get_slab(obj);
+	uint32_t slot = ebi_slab_get_slot(slab, obj);
+	ebi_atomic_and32(&slab->pin_mask[slot / 32], ~(1u << (slot % 32)));
+}
+
+// Returns the new location of `obj` if it has been moved.
+static ebi_forceinline ebi_obj *ebi_evacuate_forward(ebi_obj *obj)
+{
+	if (ebi_heap_get_slab(obj)->state != EBI_SLAB_EVACUATING) return obj;
+	uintptr_t type = (uintptr_t)obj->type;
+	return type & 1 ? (ebi_obj*)(type & ~(uintptr_t)1) : obj;
+}
+
+static ebi_forceinline void ebi_evacuate_fix_ref(void **ref)
+{
+	void *value = *ref;
+	if (value) {
+		*ref = ebi_evacuate_forward(ebi_get_obj(value)) + 1;
+	}
+}
+
+static void ebi_evacuate_fix_fields(char *ptr, ebi_type *type);
+
+static ebi_forceinline void ebi_evacuate_fix_type(char *ptr, ebi_type *type)
+{
+	uint32_t flags = type->flags;
+	if (flags & EBI_TYPE_IS_REF) {
+		ebi_evacuate_fix_ref((void**)ptr);
+	} else if (flags & EBI_TYPE_HAS_REFS) {
+		ebi_evacuate_fix_fields(ptr, type);
+	}
+}
+
+// Redirect references in the fields of `type` at `ptr`, mirrors the
+// traversal of `ebi_mark_fields()`.
+static void ebi_evacuate_fix_fields(char *ptr, ebi_type *type)
+{
+	ebi_field *begin = type->fields, *end = begin + type->num_fields;
+	for (ebi_field *f = begin; f != end; f++) {
+		ebi_evacuate_fix_type(ptr + f->offset, f->type);
+	}
+
+	if (type->flags & EBI_TYPE_HAS_SUFFIX) {
+		ebi_type *suf_type = end->type;
+		size_t suf_stride = suf_type->data_size, suf_num = *(uint32_t*)ptr;
+		char *suf_ptr = ptr + type->data_size;
+		if (suf_type->flags & (EBI_TYPE_IS_REF | EBI_TYPE_HAS_REFS)) {
+			for (; suf_num > 0; suf_num--, suf_ptr += suf_stride) {
+				ebi_evacuate_fix_type(suf_ptr, suf_type);
+			}
+		}
+	}
+}
+
+static void ebi_evacuate_fix_obj(ebi_obj *obj)
+{
+	// Skip the old copies of moved objects
+	if ((uintptr_t)obj->type & 1) return;
+	if (obj->type->flags & EBI_TYPE_HAS_REFS) {
+		ebi_evacuate_fix_fields(obj->data, obj->type);
+	}
+}
+
+static void ebi_evacuate_fix_list(ebi_objlist *list)
+{
+	for (uint32_t i = 0; i < list->count; i++) {
+		uintptr_t entry = (uintptr_t)list->objs[i];
+		ebi_obj *obj = ebi_evacuate_forward((ebi_obj*)(entry & ~(uintptr_t)1));
+		list->objs[i] = (ebi_obj*)((uintptr_t)obj | (entry & 1));
+
+		// Skip the range index of range tasks
+		if (entry & 1) i++;
+	}
+}
+
+// Copy the unpinned objects of `slab` to slots allocated by `et`.
+static void ebi_evacuate_slab(ebi_thread *et, ebi_slab *slab)
 {
 	ebi_vm *vm = et->vm;
+	uint32_t stride = slab->stride;
+	uint32_t slab_count = ebi_heap_classes[slab->cls].slab_count;
+	for (uint32_t slot = 0; slot < slab_count; slot++) {
+		uint32_t bit = 1u << (slot % 32);
+		if (!(slab->gen_g[slot] | slab->gen_n[slot])) continue;
+		if (slab->pin_mask[slot / 32] & bit) continue;
+
+		ebi_obj *obj = (ebi_obj*)(slab->data + slot * stride);
+		ebi_obj *copy = (ebi_obj*)ebi_heap_alloc(&et->heap, stride);
+		memcpy(copy, obj, stride);
+
+		ebi_slab *dst = ebi_heap_get_slab(copy);
+		uint32_t dst_slot = ebi_slab_get_slot(dst, copy);
+		dst->gen_g[dst_slot] = slab->gen_g[slot];
+		dst->gen_n[dst_slot] = slab->gen_n[slot];
+
+		// Keep remembering the references of the object
+		if (dst->gen_g[dst_slot] && (slab->cards & ebi_gc_card_bits(slab, obj, (char*)obj + stride))) {
+			ebi_gc_dirty_cards(vm, dst, ebi_gc_card_bits(dst, copy, (char*)copy + stride));
+		}
 
-	ebi_mutex_lock(&vm->thread_mutex);
-	ebi_fence_close(&vm->thread_fence);
+		if (slab->weak_mask[slot / 32] & bit) {
+			ebi_mutex_lock(&vm->weak_mutex);
+			uint32_t weak_slot = ebi_weak_table_remove(vm, obj);
+			ebi_weak_table_insert(vm, copy, weak_slot);
+			ebi_mutex_unlock(&vm->weak_mutex);
+		}
+
+		obj->type = (ebi_type*)((uintptr_t)copy | 1);
+	}
+}
+
+// Free the old copies of the moved objects in `slab`.
+static void ebi_evacuate_free_slab(ebi_vm *vm, ebi_slab *slab)
+{
+	uint32_t moved[EBI_SLAB_MAX_MASKS] = { 0 };
+	uint32_t slab_count = ebi_heap_classes[slab->cls].slab_count;
+	for (uint32_t slot = 0; slot < slab_count; slot++) {
+		if (!(slab->gen_g[slot] | slab->gen_n[slot])) continue;
+		ebi_obj *obj = (ebi_obj*)(slab->data + slot * slab->stride);
+		if ((uintptr_t)obj->type & 1) moved[slot / 32] |= 1u << (slot % 32);
+	}
+	ebi_heap_free_slots(&vm->heap, slab, moved);
+}
 
-	vm->checkpoint_fence = true;
-	vm->gen.n = vm->gen.n == 255 ? 1 : vm->gen.n + 1;
+// Redirect references to moved objects in every live object of the heap.
+static void ebi_evacuate_fix_heap(ebi_vm *vm)
+{
+	ebi_heap *heap = &vm->heap;
 
-	// TODO: Atomic release
-	vm->checkpoint++;
+	ebi_mutex_lock(&heap->reserve_mutex);
+	for (size_t ri = 0; ri < heap->num_reservations; ri++) {
+		ebi_heap_reservation *res = &heap->reservations[ri];
+		for (char *ptr = res->begin; ptr != res->end; ptr += EBI_HEAP_SLAB_SIZE) {
+			ebi_slab *slab = (ebi_slab*)ptr;
+			if (slab->state == EBI_SLAB_UNUSED || slab->state == EBI_SLAB_EMPTY) continue;
 
-	for (uint32_t i = 0; i < vm->num_threads; i++) {
-		ebi_thread *ot = vm->threads[i];
-		ebi_mutex_lock(&ot->mutex);
-		ebi_synchronize_thread(ot, false);
+			uint32_t slab_count = ebi_heap_classes[slab->cls].slab_count;
+			for (uint32_t slot = 0; slot < slab_count; slot++) {
+				if (!(slab->gen_g[slot] | slab->gen_n[slot])) continue;
+				ebi_evacuate_fix_obj((ebi_obj*)(slab->data + slot * slab->stride));
+			}
+		}
+	}
+	ebi_mutex_unlock(&heap->reserve_mutex);
+
+	ebi_mutex_lock(&heap->span_mutex);
+	for (ebi_span *span = heap->live_spans; span; span = span->live_next) {
+		ebi_slab *slab = ebi_heap_get_slab(span);
+		if (!(slab->gen_g[0] | slab->gen_n[0])) continue;
+		ebi_evacuate_fix_obj((ebi_obj*)(span + 1));
 	}
+	ebi_mutex_unlock(&heap->span_mutex);
+}
+
+// Redirect objects in mark lists and deferred links queued by write barriers
+// since marking finished. Call with all threads stopped.
+static void ebi_evacuate_fix_pending(ebi_vm *vm)
+{
+	ebi_objlist *lists = ebi_ia_pop_all(&vm->objs_mark), *tail = lists;
+	while (tail && tail->next) tail = tail->next;
 
 	for (uint32_t i = 0; i < vm->num_threads; i++) {
 		ebi_thread *ot = vm->threads[i];
-		ebi_mutex_unlock(&ot->mutex);
+		ebi_evacuate_fix_list(ot->objs_mark);
+		for (size_t li = 0; li < ot->num_defer_links; li++) {
+			ebi_evacuate_fix_ref(&ot->defer_links[li].src);
+			ebi_evacuate_fix_ref(&ot->defer_links[li].dst);
+		}
+
+		// We own the stopped threads so we can pop from their deques
+		ebi_objlist *list;
+		while ((list = (ebi_objlist*)ebi_ws_pop(&ot->mark_deque)) != NULL) {
+			list->next = NULL;
+			if (tail) tail->next = list;
+			else lists = list;
+			tail = list;
+		}
+	}
+
+	for (ebi_objlist *list = lists; list; list = list->next) {
+		ebi_evacuate_fix_list(list);
 	}
+	if (lists) ebi_ia_push_all(&vm->objs_mark, lists);
+}
 
-	ebi_fence_open(&vm->thread_fence);
+// Try to move the objects out of `vm->gc_evacuate`. Returns `true` when
+// done, either by evacuating or by giving up.
+// Call with `vm->gc_mutex` held.
+bool ebi_gc_evacuate(ebi_thread *et)
+{
+	ebi_vm *vm = et->vm;
+
+	// Threads that are not running don't hold their mutexes, stop the world
+	// by taking all of them. Holding `thread_mutex` keeps new threads out.
+	ebi_mutex_lock(&vm->thread_mutex);
+	uint32_t num_locked = 0;
+	for (; num_locked < vm->num_threads; num_locked++) {
+		ebi_thread *ot = vm->threads[num_locked];
+		if (ot != et && !ebi_mutex_try_lock(&ot->mutex)) break;
+	}
+
+	bool stopped = num_locked == vm->num_threads;
+	if (stopped) {
+		for (ebi_slab *slab = vm->gc_evacuate; slab; slab = slab->next) {
+			ebi_evacuate_slab(et, slab);
+		}
+		ebi_evacuate_fix_heap(vm);
+		ebi_evacuate_fix_pending(vm);
+		for (ebi_slab *slab = vm->gc_evacuate; slab; slab = slab->next) {
+			ebi_evacuate_free_slab(vm, slab);
+		}
+	}
+
+	for (uint32_t i = 0; i < num_locked; i++) {
+		ebi_thread *ot = vm->threads[i];
+		if (ot != et) ebi_mutex_unlock(&ot->mutex);
+	}
 	ebi_mutex_unlock(&vm->thread_mutex);
 
+	if (!stopped && ++vm->gc_evacuate_attempts < EBI_GC_EVACUATE_ATTEMPTS) return false;
+
+	ebi_heap_evacuate_end(&vm->heap, vm->gc_evacuate);
+	vm->gc_evacuate = NULL;
 	return true;
 }
 
+// -- Handshakes
+
+// Instead of stopping all threads at a fence GC requests a handshake by
+// bumping `vm->checkpoint` and then polls for the threads to acknowledge it
+// at their own pace. Threads that are not running (don't hold `et->mutex`)
+// are synchronized by the GC thread on their behalf. Nobody ever waits.
+
+// Request a new handshake, any changes to `vm->gen` must be done before.
+// Call with `vm->gc_mutex` held.
+void ebi_gc_handshake_post(ebi_thread *et)
+{
+	ebi_vm *vm = et->vm;
+
+	// Publish the new generation, threads read `checkpoint` with acquire in
+	// `ebi_checkpoint()` before looking at it.
+	uint32_t checkpoint = vm->checkpoint + 1;
+	ebi_atomic_store32_release(&vm->checkpoint, checkpoint);
+	vm->gc_checkpoint = checkpoint;
+
+	ebi_synchronize_thread(et);
+}
+
+// Returns `true` if all threads have acknowledged the latest handshake.
+// Call with `vm->gc_mutex` held.
+bool ebi_gc_handshake_done(ebi_thread *et)
+{
+	ebi_vm *vm = et->vm;
+	uint32_t checkpoint = vm->gc_checkpoint;
+	bool done = true;
+
+	ebi_mutex_lock(&vm->thread_mutex);
+	for (uint32_t i = 0; i < vm->num_threads; i++) {
+		ebi_thread *ot = vm->threads[i];
+		if (ebi_atomic_load32_acquire(&ot->checkpoint) == checkpoint) continue;
+
+		if (ot == et) {
+			ebi_synchronize_thread(et);
+		} else if (ebi_mutex_try_lock(&ot->mutex)) {
+			// The thread is idle, synchronize it ourselves
+			ebi_synchronize_thread(ot);
+			ebi_mutex_unlock(&ot->mutex);
+		} else {
+			// Running, it will get to `ebi_checkpoint()` eventually
+			done = false;
+		}
+	}
+	ebi_mutex_unlock(&vm->thread_mutex);
+
+	return done;
+}
+
 void ebi_mark_globals(ebi_thread *et, bool to_g)
 {
 	ebi_vm *vm = et->vm;
 
 }
 
+// -- Pacing
 
-void ebi_gc_step(ebi_thread *et)
+// Collections are paced by allocation volume like Go's GOGC: the next cycle
+// is due once the program has allocated `gc_growth_percent` of the live heap
+// left by the previous one, but at least `gc_min_trigger` bytes. Live bytes
+// are estimated from the heap counters as allocated minus freed.
+
+// Force a major collection after this many minor ones
+#define EBI_GC_MAX_MINOR_CYCLES 16
+
+static ebi_forceinline size_t ebi_gc_growth(ebi_vm *vm, size_t live_bytes)
+{
+	size_t growth = (size_t)((uint64_t)live_bytes * vm->gc_growth_percent / 100);
+	return growth > vm->gc_min_trigger ? growth : vm->gc_min_trigger;
+}
+
+// Minor collections never free G objects, so do a major one once the live
+// heap has grown past the last major collection by the pacing ratio.
+static bool ebi_gc_choose_major(ebi_vm *vm)
+{
+	if (vm->gc_minor_cycles >= EBI_GC_MAX_MINOR_CYCLES) return true;
+	return vm->gc_live_bytes >= vm->gc_major_live_bytes + ebi_gc_growth(vm, vm->gc_major_live_bytes);
+}
+
+// Return the memory freed by the cycle and start waiting for the next one.
+static void ebi_gc_finish(ebi_vm *vm)
+{
+	ebi_heap *heap = &vm->heap;
+	ebi_heap_release_spans(heap);
+	ebi_heap_scavenge(heap);
+
+	uint64_t alloc_bytes = ebi_atomic_load64_relaxed(&heap->alloc_bytes);
+	uint64_t freed_bytes = ebi_atomic_load64_relaxed(&heap->freed_bytes);
+	size_t live_bytes = alloc_bytes > freed_bytes ? (size_t)(alloc_bytes - freed_bytes) : 0;
+	vm->gc_live_bytes = live_bytes;
+	if (vm->gc_major) {
+		vm->gc_major_live_bytes = live_bytes;
+		vm->gc_minor_cycles = 0;
+	} else {
+		vm->gc_minor_cycles++;
+	}
+
+	ebi_atomic_store64_relaxed(&heap->alloc_trigger, alloc_bytes + ebi_gc_growth(vm, live_bytes));
+	vm->gc_stage = EBI_GC_IDLE;
+}
+
+// Returns `true` if a collection is running or due.
+static bool ebi_gc_pending(ebi_vm *vm)
+{
+	if (*(volatile ebi_gc_stage*)&vm->gc_stage != EBI_GC_IDLE) return true;
+	uint64_t alloc_bytes = ebi_atomic_load64_relaxed(&vm->heap.alloc_bytes);
+	return alloc_bytes >= ebi_atomic_load64_relaxed(&vm->heap.alloc_trigger);
+}
+
+// Do a unit of GC work and advance the collection if possible.
+// Returns `false` if there was nothing to do, eg. waiting for handshakes.
+static bool ebi_gc_work(ebi_thread *et)
 {
 	ebi_vm *vm = et->vm;
 
 	ebi_checkpoint(et);
 
-	uintptr_t mark_count = ebi_ia_get_count(&vm->objs_mark);
 	bool mark = ebi_gc_mark(et);
 	bool sweep = ebi_gc_sweep(et);
 	if (!mark && et->objs_mark->count) {
@@ -671,27 +1816,252 @@ void ebi_gc_step(ebi_thread *et)
 		mark = ebi_gc_mark(et);
 	}
 
-	ebi_mutex_lock(&vm->gc_mutex);
-	switch (vm->gc_stage) {
+	if (!ebi_mutex_try_lock(&vm->gc_mutex)) return mark || sweep;
+	ebi_gc_stage stage = vm->gc_stage;
+	uintptr_t mark_count;
+	switch (stage) {
 	case EBI_GC_IDLE:
-		ebi_mark_globals(et, vm->gc_major);
-		vm->gc_stage = EBI_GC_MARK;
+		vm->gc_major = ebi_gc_choose_major(vm);
+
+		// Bump the generation at the start of the cycle so that marking and
+		// allocations during it use the new one and sweep can compare to it.
+		vm->gen.n = vm->gen.n == 255 ? 1 : vm->gen.n + 1;
+		if (vm->gc_major) {
+			vm->gen.g = vm->gen.g == 255 ? 1 : vm->gen.g + 1;
+			ebi_gc_clear_cards(vm);
+		}
+		vm->gc_marking = true;
+		ebi_gc_handshake_post(et);
+		vm->gc_stage = EBI_GC_START;
+		break;
+	case EBI_GC_START:
+		if (ebi_gc_handshake_done(et)) {
+			ebi_mark_globals(et, vm->gc_major);
+			if (!vm->gc_major) ebi_gc_mark_cards(et);
+			vm->gc_stage = EBI_GC_MARK;
+		}
 		break;
 	case EBI_GC_MARK:
-		if (!mark) {
-			ebi_thread_barrier(et);
-			vm->gc_stage = EBI_GC_SWEEP;
-			ebi_ia_push_all(&vm->objs_sweep, ebi_ia_pop_all(&vm->objs_alive[EBI_ALIVE_N1]));
-			if (vm->gc_major) {
-				ebi_ia_push_all(&vm->objs_sweep_next, ebi_ia_pop_all(&vm->objs_alive[EBI_ALIVE_G]));
+		if (!mark && !ebi_gc_mark_pending(vm, &mark_count)) {
+			// All queues look empty: ask threads to flush their pending links
+			// and marks. Threads only acknowledge between mark steps so any
+			// list they were traversing is done by then.
+			vm->gc_mark_count = mark_count;
+			ebi_gc_handshake_post(et);
+			vm->gc_stage = EBI_GC_MARK_SYNC;
+		}
+		break;
+	case EBI_GC_MARK_SYNC:
+		if (ebi_gc_handshake_done(et)) {
+			// Done if nothing was pushed since the handshake was posted
+			if (ebi_gc_mark_pending(vm, &mark_count) || mark_count != vm->gc_mark_count) {
+				vm->gc_stage = EBI_GC_MARK;
+			} else {
+				// Let threads switch back to the cheaper barrier, nobody
+				// needs to wait for it
+				vm->gc_marking = false;
+				ebi_gc_handshake_post(et);
+				ebi_heap_sweep_begin(&vm->heap, vm->gen.g, vm->gen.n);
+				vm->gc_stage = EBI_GC_SWEEP;
 			}
 		}
 		break;
 	case EBI_GC_SWEEP:
-		vm->gc_stage = EBI_GC_IDLE;
+		if (ebi_heap_sweep_done(&vm->heap)) {
+			if (vm->gc_major) {
+				vm->gc_evacuate = ebi_heap_evacuate_begin(&vm->heap);
+				vm->gc_evacuate_attempts = 0;
+			}
+			if (vm->gc_evacuate) {
+				vm->gc_stage = EBI_GC_EVACUATE;
+			} else {
+				ebi_gc_finish(vm);
+			}
+		}
+		break;
+	case EBI_GC_EVACUATE:
+		if (ebi_gc_evacuate(et)) {
+			ebi_gc_finish(vm);
+		}
 		break;
 	}
+	bool advanced = vm->gc_stage != stage;
 	ebi_mutex_unlock(&vm->gc_mutex);
+
+	return mark || sweep || advanced;
+}
+
+void ebi_gc_step(ebi_thread *et)
+{
+	ebi_gc_work(et);
+}
+
+// -- Assists
+
+// Threads that allocate during a collection pay for it by doing mark or
+// sweep work in proportion to what they allocate, so a thread allocating
+// faster than the GC threads can collect slows down instead of growing the
+// heap without bound.
+
+// Pay off allocation debt, called from the allocation path.
+void ebi_gc_assist(ebi_thread *et)
+{
+	ebi_vm *vm = et->vm;
+	ebi_checkpoint(et);
+
+	// Wait for the next handshake to start accruing again
+	if (*(volatile ebi_gc_stage*)&vm->gc_stage == EBI_GC_IDLE) {
+		et->assist_limit = UINT64_MAX;
+		return;
+	}
+
+	uint64_t allocated = et->heap.alloc_bytes;
+	while (et->assist_limit < allocated) {
+		if (ebi_gc_mark(et)) {
+			et->assist_limit += EBI_GC_ASSIST_MARK_CREDIT;
+		} else if (et->objs_mark->count > 0) {
+			ebi_flush_marks(et);
+		} else if (ebi_gc_sweep(et)) {
+			et->assist_limit += EBI_GC_ASSIST_SWEEP_CREDIT;
+		} else {
+			// Nothing to help with, the debt is on the GC threads. Grant new
+			// headroom instead of checking again on the next refill.
+			et->assist_limit = allocated + EBI_GC_ASSIST_HEADROOM;
+			break;
+		}
+	}
+}
+
+// -- Workers
+
+// Spin this many steps without progress before sleeping between steps
+#define EBI_GC_WORKER_SPIN_STEPS 64
+
+static void ebi_gc_worker_main(void *user)
+{
+	ebi_thread *et = (ebi_thread*)user;
+	ebi_vm *vm = et->vm;
+	ebi_fence *wake = &vm->heap.alloc_fence;
+	uint32_t idle_steps = 0;
+
+	for (;;) {
+		if (!ebi_gc_pending(vm)) {
+			// Close before checking again: allocations that cross the trigger
+			// after this open the fence, earlier ones are seen by the check.
+			ebi_fence_close(wake);
+			if (!ebi_gc_pending(vm)) {
+				ebi_fence_wait(wake);
+			}
+			idle_steps = 0;
+			continue;
+		}
+
+		// Stay locked while working so that handshakes wait for us to reach
+		// a checkpoint instead of synchronizing us in the middle of a step
+		ebi_lock_thread(et);
+		bool progress = ebi_gc_work(et);
+		ebi_unlock_thread(et);
+
+		// Waiting for mutators to reach their checkpoints
+		if (progress) {
+			idle_steps = 0;
+		} else if (++idle_steps >= EBI_GC_WORKER_SPIN_STEPS) {
+			ebi_os_sleep_ms(1);
+		}
+	}
+}
+
+bool ebi_gc_start_workers(ebi_vm *vm, uint32_t num_workers)
+{
+	for (uint32_t i = 0; i < num_workers; i++) {
+		ebi_thread *et = ebi_make_thread(vm);
+		if (!et) return false;
+		if (!ebi_os_start_thread(&ebi_gc_worker_main, et)) return false;
+	}
+	return true;
+}
+
+// -- VM and threads
+
+ebi_vm *ebi_make_vm()
+{
+	ebi_vm *vm = (ebi_vm*)calloc(1, sizeof(ebi_vm));
+	if (!vm) return NULL;
+
+	vm->thread_set = (ebi_thread_set*)calloc(1, sizeof(ebi_thread_set) + 16 * sizeof(ebi_thread*));
+	if (!vm->thread_set) {
+		free(vm);
+		return NULL;
+	}
+	vm->thread_set->capacity = 16;
+
+	ebi_heap_init(&vm->heap);
+	vm->gen.g = 1;
+	vm->gen.n = 1;
+
+	vm->gc_growth_percent = EBI_GC_DEFAULT_GROWTH_PERCENT;
+	vm->gc_min_trigger = EBI_GC_DEFAULT_MIN_TRIGGER;
+	vm->heap.alloc_trigger = EBI_GC_DEFAULT_MIN_TRIGGER;
+
+	return vm;
+}
+
+ebi_thread *ebi_make_thread(ebi_vm *vm)
+{
+	ebi_thread *et = (ebi_thread*)calloc(1, sizeof(ebi_thread));
+	if (!et) return NULL;
+
+	et->vm = vm;
+	ebi_heap_init_cache(&et->heap, &vm->heap);
+
+	et->objs_mark = ebi_alloc_objlist(vm);
+	et->assist_limit = UINT64_MAX;
+
+	ebi_mutex_lock(&vm->thread_mutex);
+	et->gen = vm->gen;
+	et->gc_marking = vm->gc_marking;
+	et->checkpoint = vm->checkpoint;
+	if (vm->num_threads == vm->max_threads) {
+		vm->max_threads = ebi_grow_sz(vm->max_threads, 16);
+		vm->threads = (ebi_thread**)realloc(vm->threads, vm->max_threads * sizeof(ebi_thread*));
+		ebi_assert(vm->threads);
+	}
+	vm->threads[vm->num_threads++] = et;
+
+	ebi_thread_set *set = vm->thread_set;
+	if (set->num == set->capacity) {
+		uint32_t capacity = set->capacity * 2;
+		ebi_thread_set *grown = (ebi_thread_set*)malloc(sizeof(ebi_thread_set) + capacity * sizeof(ebi_thread*));
+		ebi_assert(grown);
+		grown->retired = set;
+		grown->num = set->num;
+		grown->capacity = capacity;
+		memcpy(grown->threads, set->threads, set->num * sizeof(ebi_thread*));
+		set = grown;
+	}
+	set->threads[set->num] = et;
+	ebi_atomic_store32_release(&set->num, set->num + 1);
+	if (set != vm->thread_set) {
+		ebi_atomic_fence_release();
+		*(ebi_thread_set *volatile*)&vm->thread_set = set;
+	}
+	ebi_mutex_unlock(&vm->thread_mutex);
+
+	return et;
+}
+
+// Threads hold their mutex while running, GC synchronizes unlocked threads on
+// their behalf, see `ebi_gc_handshake_done()`.
+void ebi_lock_thread(ebi_thread *et)
+{
+	ebi_mutex_lock(&et->mutex);
+	ebi_checkpoint(et);
+}
+
+void ebi_unlock_thread(ebi_thread *et)
+{
+	ebi_checkpoint(et);
+	ebi_mutex_unlock(&et->mutex);
 }
 
 #if 0
@@ -1,19 +1,14 @@
 #pragma once
 
-#include <stdint.h>
-#include <stdbool.h>
+#include "ebi_platform.h"
+
 #include <stddef.h>
 
-#define ebi_assert(cond) do { if (!(cond)) __debugbreak(); } while (0)
 #define ebi_static_assert(name, cond) typedef int ebi_assert_##name[(cond) ? 1 : -1]
 #define ebi_arraycount(arr) (sizeof(arr)/sizeof(*(arr)))
 #define ebi_ptr
 #define ebi_arr
 
-#define ebi_forceinline __forceinline
-
-#define EBI_DEBUG 1
-
 typedef struct ebi_vm ebi_vm;
 typedef struct ebi_thread ebi_thread;
 typedef struct ebi_type_info ebi_type_info;
@@ -84,6 +79,15 @@ typedef enum {
 	EBI_TYPE_HAS_SUFFIX = 0x4,
 } ebi_type_flags;
 
+// How marking finds the references in a type, see `ebi_init_type()`.
+typedef enum {
+	EBI_TYPE_MARK_FIELDS,   // Recurse through `fields`, for types without a map
+	EBI_TYPE_MARK_ONE_REF,  // A single reference at `ref_offset`
+	EBI_TYPE_MARK_ALL_REFS, // `num_refs` consecutive references from offset 0
+	EBI_TYPE_MARK_BITMAP,   // References at the pointer sized words in `ref_bitmap`
+	EBI_TYPE_MARK_OFFSETS,  // References at `ref_offsets[num_refs]`
+} ebi_type_mark;
+
 struct ebi_type {
 	size_t num_total_fields;
 	ebi_type_info *info;
@@ -91,10 +95,42 @@ struct ebi_type {
 	uint32_t ref_size;
 	uint32_t data_size;
 	uint32_t elem_size;
+
+	// Flattened reference map of the fields, excluding the suffix
+	uint32_t mark; // `ebi_type_mark`
+	uint32_t num_refs;
+	uint32_t ref_offset;
+	uint64_t ref_bitmap;
+	uint32_t *ref_offsets;
+
 	uint32_t num_fields;
 	ebi_field fields[];
 };
 
+#define EBI_HEAP_STATS_MAX_CLASSES 64
+
+typedef struct ebi_heap_class_stats {
+	size_t slot_size;
+	size_t num_slabs;
+	size_t live_slots;
+	size_t free_slots;
+} ebi_heap_class_stats;
+
+// Approximate snapshot of the heap, see `ebi_get_heap_stats()`.
+typedef struct ebi_heap_stats {
+	size_t num_classes;
+	ebi_heap_class_stats classes[EBI_HEAP_STATS_MAX_CLASSES];
+	size_t num_empty_slabs;
+	size_t num_decommitted_slabs; // Empty slabs returned to the OS
+	size_t slab_bytes;
+	size_t live_bytes;
+	size_t large_bytes;
+	size_t num_large_objects;
+
+	// Fraction of slot capacity in non-empty slabs not used by live objects
+	double fragmentation;
+} ebi_heap_stats;
+
 ebi_vm *ebi_make_vm();
 ebi_thread *ebi_make_thread(ebi_vm *vm);
 ebi_types *ebi_get_types(ebi_vm *vm);
@@ -110,6 +146,13 @@ void ebi_set_string(ebi_thread *et, ebi_string *dst, const ebi_string *src);
 
 ebi_type *ebi_new_type(ebi_thread *et, const ebi_type_desc *desc);
 
+// Flatten the references of `type` and nested value types into a map for
+// marking, call once `fields` is filled in. Also initializes the suffix
+// element type. Types with references must be initialized before their
+// objects are marked: without a map marking falls back to walking the
+// fields, which debug builds assert on.
+void ebi_init_type(ebi_type *type);
+
 ebi_string ebi_new_string(ebi_thread *et, const char *data, size_t length);
 ebi_string ebi_new_stringz(ebi_thread *et, const char *data);
 
@@ -118,9 +161,58 @@ void ebi_unlock_thread(ebi_thread *et);
 
 void ebi_checkpoint(ebi_thread *et);
 
+void ebi_set_alloc_profile(ebi_vm *vm, bool enabled);
+bool ebi_dump_alloc_profile(ebi_vm *vm, const char *path);
+
+// Cheap enough to poll while mutators are running, the counts may be
+// slightly inconsistent with each other.
+void ebi_get_heap_stats(ebi_vm *vm, ebi_heap_stats *stats);
+
+// Keep `reserve_bytes` worth of empty slabs ready for reuse and return the
+// rest to the OS once they have been unused for `idle_cycles` GC cycles.
+void ebi_set_heap_scavenge(ebi_vm *vm, size_t reserve_bytes, uint32_t idle_cycles);
+
+// Move the live objects out of slabs with at most `max_occupancy` of their
+// slots in use during major collections, copying at most `max_bytes` per
+// collection. The sparsest slabs are evacuated first. Off by default: only
+// references stored in the heap are updated so objects that are referenced
+// from native code must be pinned with `ebi_pin()`. All threads are stopped
+// while the references are updated and every live object in the heap is
+// scanned for them, so the pause grows with the size of the heap, not with
+// `max_bytes`.
+void ebi_set_heap_evacuation(ebi_vm *vm, double max_occupancy, size_t max_bytes);
+
+#define EBI_GC_DEFAULT_GROWTH_PERCENT 100
+#define EBI_GC_DEFAULT_MIN_TRIGGER (4*1024*1024)
+
+// Start the next collection once `growth_percent` of the live heap left by
+// the previous one has been allocated, but not before `min_trigger_bytes`.
+// Used by the GC workers, see `ebi_gc_start_workers()`.
+void ebi_set_gc_pacing(ebi_vm *vm, uint32_t growth_percent, size_t min_trigger_bytes);
+
+// Back the slab heap with transparent huge pages if the OS supports them.
+// Only affects memory reserved afterwards so set it right after creating
+// the VM. Costs memory: slabs of small classes only touch their first pages
+// but huge pages back the whole slab, and empty slabs are not returned to
+// the OS while enabled.
+void ebi_set_heap_huge_pages(ebi_vm *vm, bool enabled);
+
+// Let allocating threads sweep slabs they are about to reuse during the sweep
+// phase instead of leaving all of it to the GC, enabled by default.
+void ebi_set_heap_lazy_sweep(ebi_vm *vm, bool enabled);
+
+// Prevent evacuation from moving the object at `ptr`.
+void ebi_pin(ebi_thread *et, void *ptr);
+void ebi_unpin(ebi_thread *et, void *ptr);
+
 void ebi_gc_assist(ebi_thread *et);
 void ebi_gc_step(ebi_thread *et);
 
+// Run collections in the background on `num_workers` threads for the lifetime
+// of the VM. Workers sleep until enough has been allocated to start a cycle,
+// see `ebi_set_gc_pacing()`, and choose between minor and major collections.
+bool ebi_gc_start_workers(ebi_vm *vm, uint32_t num_workers);
+
 ebi_weak_ref ebi_make_weak_ref(ebi_thread *et, ebi_ptr void *ptr);
 ebi_ptr void *ebi_resolve_weak_ref(ebi_thread *et, ebi_weak_ref ref);
 
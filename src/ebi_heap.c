@@ -1,39 +1,54 @@
 #include "ebi_heap.h"
 #include "ebi_intrin.h"
+#include "ebi_os.h"
+
+#include <stdlib.h>
+#include <string.h>
 
 // Generated by misc/make_heap_sizes.py
 const ebi_heap_class ebi_heap_classes[EBI_HEAP_CLASSES] = {
-        {   16,    0, 128 }, {   32,  128, 128 }, {   48,  256, 128 },
-        {   64,  384, 128 }, {   80,  512, 128 }, {   96,  640, 128 },
-        {  112,  768, 128 }, {  128,  896, 127 }, {  160, 1023, 102 },
-        {  192, 1125,  85 }, {  224, 1210,  72 }, {  256, 1282,  63 },
-        {  320, 1345,  51 }, {  384, 1396,  42 }, {  448, 1438,  36 },
-        {  512, 1474,  31 }, {  768, 1505,  21 }, { 1024, 1526,  15 },
-        { 1280, 1541,  12 }, { 1536, 1553,  10 }, { 1792, 1563,   9 },
-        { 2048, 1572,   7 },
+	{   16,    0, 128 }, {   24,  128, 128 }, {   32,  256, 128 },
+	{   40,  384, 128 }, {   48,  512, 128 }, {   56,  640, 128 },
+	{   64,  768, 128 }, {   80,  896, 128 }, {   96, 1024, 128 },
+	{  112, 1152, 128 }, {  128, 1280, 125 }, {  160, 1405, 100 },
+	{  192, 1505,  83 }, {  224, 1588,  71 }, {  256, 1659,  62 },
+	{  320, 1721,  50 }, {  384, 1771,  41 }, {  448, 1812,  35 },
+	{  512, 1847,  31 }, {  768, 1878,  20 }, { 1024, 1898,  15 },
+	{ 1280, 1913,  12 }, { 1536, 1925,  10 }, { 1792, 1935,   8 },
+	{ 2048, 1943,   7 },
 };
-
-const uint8_t ebi_heap_size_to_class[128] = {
-         0,  1,  2,  3,  4,  5,  6,  7,  8,  8,  9,  9, 10, 10, 11, 11,
-        12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15,
-        16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
-        17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
-        18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18,
-        19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19,
-        20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
-        21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+const uint8_t ebi_heap_size_to_class[256] = {
+	 0,  0,  1,  2,  3,  4,  5,  6,  7,  7,  8,  8,  9,  9, 10, 10,
+	11, 11, 11, 11, 12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14,
+	15, 15, 15, 15, 15, 15, 15, 15, 16, 16, 16, 16, 16, 16, 16, 16,
+	17, 17, 17, 17, 17, 17, 17, 17, 18, 18, 18, 18, 18, 18, 18, 18,
+	19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19,
+	19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19,
+	20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
+	20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
+	21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+	21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+	22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22,
+	22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22,
+	23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23,
+	23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23,
+	24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+	24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
 };
 
-size_t ebi_slab_get_free(ebi_slab *slab, uint8_t *dst)
+// -- Free slot decoding
+
+// Decoders expand up to 8 free slot masks into a list of slot indices. They
+// may write garbage past the returned count but never more than
+// `EBI_SLAB_MAX_SLOTS` bytes in total.
+
+typedef size_t ebi_slab_decode_fn(const uint32_t *masks, uint32_t num_masks, uint8_t *dst);
+
+static size_t ebi_slab_decode_swar(const uint32_t *masks, uint32_t num_masks, uint8_t *dst)
 {
 	uint8_t *d = dst;
 
-	uint32_t masks[8];
-	for (uint32_t i = 0; i < slab->num_masks; i++) {
-		masks[i] = ebi_atomic_xhg32(&slab->mask[i], 0);
-	}
-
-	for (uint32_t i = 0; i < slab->num_masks; i++) {
+	for (uint32_t i = 0; i < num_masks; i++) {
 		uint32_t mask = masks[i];
 
 		// Process masks one nibble (4 bits) at a time. We can use SWAR to
@@ -49,11 +64,11 @@ size_t ebi_slab_get_free(ebi_slab *slab, uint8_t *dst)
 
 		uint32_t offset = i * 32, end = offset + 32;
 		while (offset != end) {
-			d[0]       = (uint8_t)(offset + 0);
-			d[nb_pop1] = (uint8_t)(offset + 1);
-			d[nb_pop2] = (uint8_t)(offset + 2);
-			d[nb_pop3] = (uint8_t)(offset + 3);
-			d += nb_pop4;
+			d[0]             = (uint8_t)(offset + 0);
+			d[nb_pop1 & 0xf] = (uint8_t)(offset + 1);
+			d[nb_pop2 & 0xf] = (uint8_t)(offset + 2);
+			d[nb_pop3 & 0xf] = (uint8_t)(offset + 3);
+			d += nb_pop4 & 0xf;
 
 			nb_pop1 >>= 4;
 			nb_pop2 >>= 4;
@@ -65,3 +80,999 @@ size_t ebi_slab_get_free(ebi_slab *slab, uint8_t *dst)
 
 	return (size_t)(d - dst);
 }
+
+#if EBI_CPU_X86
+
+#if EBI_CC_MSC
+	#include <intrin.h>
+#else
+	#include <cpuid.h>
+#endif
+#include <immintrin.h>
+
+// Indices of set bits for every byte value, packed into 8 bytes
+static uint64_t ebi_slab_byte_lut[256];
+
+static void ebi_slab_init_lut()
+{
+	for (uint32_t b = 0; b < 256; b++) {
+		uint64_t v = 0;
+		uint32_t n = 0;
+		for (uint32_t i = 0; i < 8; i++) {
+			if (b & (1u << i)) v |= (uint64_t)i << (n++ * 8);
+		}
+		ebi_slab_byte_lut[b] = v;
+	}
+}
+
+static void ebi_cpuid(uint32_t leaf, uint32_t sub, uint32_t *regs)
+{
+#if EBI_CC_MSC
+	__cpuidex((int*)regs, (int)leaf, (int)sub);
+#else
+	__cpuid_count(leaf, sub, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static uint64_t ebi_xgetbv()
+{
+#if EBI_CC_MSC
+	return _xgetbv(0);
+#else
+	uint32_t lo, hi;
+	__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return (uint64_t)hi << 32 | lo;
+#endif
+}
+
+// Returns a bitmask of supported `ebi_slab_decoder` values.
+static uint32_t ebi_slab_detect_decoders()
+{
+	uint32_t supported = 1u << EBI_SLAB_DECODE_SWAR;
+
+	uint32_t regs[4];
+	ebi_cpuid(0, 0, regs);
+	if (regs[0] < 7) return supported;
+
+	// The OS must save the YMM/ZMM state (OSXSAVE + XCR0)
+	ebi_cpuid(1, 0, regs);
+	if (!(regs[2] & (1u << 27))) return supported;
+	uint64_t xcr0 = ebi_xgetbv();
+
+	ebi_cpuid(7, 0, regs);
+	bool avx2 = (regs[1] & (1u << 5)) != 0;
+	bool avx512f = (regs[1] & (1u << 16)) != 0;
+	bool avx512bw = (regs[1] & (1u << 30)) != 0;
+	bool avx512vbmi2 = (regs[2] & (1u << 6)) != 0;
+
+	if (avx2 && (xcr0 & 0x6) == 0x6) {
+		supported |= 1u << EBI_SLAB_DECODE_AVX2;
+	}
+	if (avx512f && avx512bw && avx512vbmi2 && (xcr0 & 0xe6) == 0xe6) {
+		supported |= 1u << EBI_SLAB_DECODE_AVX512_VBMI2;
+	}
+
+	return supported;
+}
+
+// Look up the indices of each byte of the mask from a table and add the
+// base offsets of the bytes in parallel.
+ebi_target("avx2,popcnt")
+static size_t ebi_slab_decode_avx2(const uint32_t *masks, uint32_t num_masks, uint8_t *dst)
+{
+	uint8_t *d = dst;
+	const __m256i byte_base = _mm256_set_epi64x(
+		0x1818181818181818ll, 0x1010101010101010ll, 0x0808080808080808ll, 0);
+
+	for (uint32_t i = 0; i < num_masks; i++) {
+		uint32_t mask = masks[i];
+		uint32_t b0 = mask & 0xff, b1 = (mask >> 8) & 0xff;
+		uint32_t b2 = (mask >> 16) & 0xff, b3 = mask >> 24;
+
+		__m256i v = _mm256_set_epi64x(
+			(long long)ebi_slab_byte_lut[b3], (long long)ebi_slab_byte_lut[b2],
+			(long long)ebi_slab_byte_lut[b1], (long long)ebi_slab_byte_lut[b0]);
+		v = _mm256_add_epi8(v, _mm256_add_epi8(byte_base, _mm256_set1_epi8((char)(i * 32))));
+
+		__m128i lo = _mm256_castsi256_si128(v);
+		__m128i hi = _mm256_extracti128_si256(v, 1);
+		_mm_storel_epi64((__m128i*)d, lo);
+		d += _mm_popcnt_u32(b0);
+		_mm_storel_epi64((__m128i*)d, _mm_unpackhi_epi64(lo, lo));
+		d += _mm_popcnt_u32(b1);
+		_mm_storel_epi64((__m128i*)d, hi);
+		d += _mm_popcnt_u32(b2);
+		_mm_storel_epi64((__m128i*)d, _mm_unpackhi_epi64(hi, hi));
+		d += _mm_popcnt_u32(b3);
+	}
+
+	return (size_t)(d - dst);
+}
+
+// `vpcompressb` does the whole compaction for 64 slots at a time.
+ebi_target("avx512f,avx512bw,avx512vbmi2,popcnt")
+static size_t ebi_slab_decode_avx512_vbmi2(const uint32_t *masks, uint32_t num_masks, uint8_t *dst)
+{
+	uint8_t *d = dst;
+	const __m512i iota = _mm512_set_epi64(
+		0x3f3e3d3c3b3a3938ll, 0x3736353433323130ll, 0x2f2e2d2c2b2a2928ll, 0x2726252423222120ll,
+		0x1f1e1d1c1b1a1918ll, 0x1716151413121110ll, 0x0f0e0d0c0b0a0908ll, 0x0706050403020100ll);
+
+	for (uint32_t i = 0; i < num_masks; i += 2) {
+		uint64_t mask = masks[i];
+		if (i + 1 < num_masks) mask |= (uint64_t)masks[i + 1] << 32;
+
+		__m512i ix = _mm512_add_epi8(iota, _mm512_set1_epi8((char)(i * 32)));
+		_mm512_storeu_si512(d, _mm512_maskz_compress_epi8(mask, ix));
+		d += _mm_popcnt_u64(mask);
+	}
+
+	return (size_t)(d - dst);
+}
+
+#endif
+
+static ebi_slab_decode_fn *const ebi_slab_decoders[EBI_SLAB_DECODE_COUNT] = {
+	&ebi_slab_decode_swar,
+#if EBI_CPU_X86
+	&ebi_slab_decode_avx2,
+	&ebi_slab_decode_avx512_vbmi2,
+#else
+	NULL,
+	NULL,
+#endif
+};
+
+// Detected once, racy initialization is fine as every thread computes the
+// same values. Zero means not initialized as SWAR is always supported.
+static uint32_t ebi_slab_supported_decoders;
+static ebi_slab_decode_fn *ebi_slab_best_decoder;
+
+static ebi_noinline void ebi_slab_init_decoders()
+{
+	uint32_t supported = 1u << EBI_SLAB_DECODE_SWAR;
+#if EBI_CPU_X86
+	ebi_slab_init_lut();
+	supported = ebi_slab_detect_decoders();
+#endif
+
+	ebi_slab_decode_fn *best = &ebi_slab_decode_swar;
+	for (uint32_t i = 0; i < EBI_SLAB_DECODE_COUNT; i++) {
+		if (supported & (1u << i)) best = ebi_slab_decoders[i];
+	}
+
+	*(ebi_slab_decode_fn* volatile*)&ebi_slab_best_decoder = best;
+	ebi_atomic_store32_release(&ebi_slab_supported_decoders, supported);
+}
+
+bool ebi_slab_decoder_supported(ebi_slab_decoder decoder)
+{
+	uint32_t supported = ebi_atomic_load32_acquire(&ebi_slab_supported_decoders);
+	if (!supported) {
+		ebi_slab_init_decoders();
+		supported = ebi_slab_supported_decoders;
+	}
+	return (supported & (1u << decoder)) != 0;
+}
+
+size_t ebi_slab_decode(ebi_slab_decoder decoder, const uint32_t *masks, uint32_t num_masks, uint8_t *dst)
+{
+	ebi_assert(ebi_slab_decoder_supported(decoder));
+	return ebi_slab_decoders[decoder](masks, num_masks, dst);
+}
+
+size_t ebi_slab_get_free(ebi_slab *slab, uint8_t *dst)
+{
+	uint32_t masks[EBI_SLAB_MAX_MASKS];
+	uint32_t num_masks = slab->num_masks;
+	for (uint32_t i = 0; i < num_masks; i++) {
+		// Acquire pairs with the release when freeing a slot so we don't
+		// reuse the memory before whoever freed it is done reading it.
+		masks[i] = ebi_atomic_xhg32_acquire(&slab->mask[i], 0);
+	}
+
+	if (!ebi_atomic_load32_acquire(&ebi_slab_supported_decoders)) {
+		ebi_slab_init_decoders();
+	}
+	return ebi_slab_best_decoder(masks, num_masks, dst);
+}
+
+// -- Slab manager
+
+ebi_static_assert(slab_header_size, offsetof(ebi_slab, data) == EBI_SLAB_HEADER_SIZE);
+ebi_static_assert(slab_max_size, EBI_HEAP_MAX_CLASS_SIZE < 4096 && EBI_HEAP_SLAB_SIZE <= 16384);
+
+void ebi_heap_init(ebi_heap *heap)
+{
+	memset(heap, 0, sizeof(ebi_heap));
+	heap->page_size = ebi_os_page_size();
+	heap->scavenge_reserve = EBI_HEAP_DEFAULT_SCAVENGE_RESERVE;
+	heap->scavenge_cycles = EBI_HEAP_DEFAULT_SCAVENGE_CYCLES;
+	heap->alloc_trigger = UINT64_MAX;
+	heap->lazy_sweep = true;
+	ebi_fence_close(&heap->alloc_fence);
+}
+
+// Account for `bytes` of new allocations, wakes up anyone waiting for the
+// allocation trigger if we cross it.
+static void ebi_heap_count_alloc(ebi_heap *heap, size_t bytes)
+{
+	uint64_t prev = ebi_atomic_add64(&heap->alloc_bytes, bytes);
+	uint64_t trigger = ebi_atomic_load64_relaxed(&heap->alloc_trigger);
+	if (prev < trigger && prev + bytes >= trigger) {
+		ebi_fence_open(&heap->alloc_fence);
+	}
+}
+
+void ebi_heap_init_cache(ebi_heap_cache *c, ebi_heap *heap)
+{
+	memset(c->classes, 0, sizeof(c->classes));
+	c->alloc_bytes = 0;
+	c->heap = heap;
+}
+
+// Initialize `slab` for class `cls` with all slots claimed by the owner.
+static void ebi_heap_init_slab(ebi_heap *heap, ebi_slab *slab, uint32_t cls)
+{
+	const ebi_heap_class *hc = &ebi_heap_classes[cls];
+	slab->next = NULL;
+	slab->num_masks = (uint8_t)((hc->slab_count + 31) / 32);
+	slab->cls = (uint8_t)cls;
+	slab->stride = hc->max_size;
+	slab->slot_mul = (uint32_t)((((uint64_t)1 << 32) + hc->max_size - 1) / hc->max_size);
+	slab->state = EBI_SLAB_OWNED;
+
+	// Nothing to sweep in the current cycle, all objects are new
+	slab->sweep_epoch = (uint32_t)(ebi_atomic_load64_relaxed(&heap->sweep_cursor) >> 32);
+	slab->idle_cycles = 0;
+	slab->cards = 0;
+	for (uint32_t i = 0; i < EBI_SLAB_MAX_MASKS; i++) {
+		slab->mask[i] = 0;
+		slab->weak_mask[i] = 0;
+		slab->pin_mask[i] = 0;
+	}
+	memset(slab->gen_g, 0, sizeof(slab->gen_g));
+	memset(slab->gen_n, 0, sizeof(slab->gen_n));
+}
+
+// Carve a new slab from the current address space reservation.
+static ebi_slab *ebi_heap_carve_slab(ebi_heap *heap)
+{
+	ebi_mutex_lock(&heap->reserve_mutex);
+
+	if ((size_t)(heap->reserve_end - heap->reserve_pos) < EBI_HEAP_SLAB_SIZE) {
+		char *base = NULL;
+		if (heap->huge_pages) {
+			// Falls back to normal pages if the OS says no
+			base = (char*)ebi_os_reserve_aligned(EBI_HEAP_RESERVE_SIZE, EBI_HEAP_HUGE_PAGE_SIZE);
+			if (base) ebi_os_advise_huge_pages(base, EBI_HEAP_RESERVE_SIZE);
+		}
+		if (!base) base = (char*)ebi_os_reserve(EBI_HEAP_RESERVE_SIZE);
+		ebi_assert(base);
+
+		// Align slabs to their size, wastes at most one slab per reservation
+		uintptr_t pos = ((uintptr_t)base + EBI_HEAP_SLAB_SIZE - 1) & ~(uintptr_t)(EBI_HEAP_SLAB_SIZE - 1);
+		heap->reserve_pos = (char*)pos;
+		heap->reserve_end = base + EBI_HEAP_RESERVE_SIZE;
+
+		if (heap->num_reservations == heap->max_reservations) {
+			heap->max_reservations = heap->max_reservations ? heap->max_reservations * 2 : 16;
+			heap->reservations = (ebi_heap_reservation*)realloc(heap->reservations,
+				heap->max_reservations * sizeof(ebi_heap_reservation));
+			ebi_assert(heap->reservations);
+		}
+		ebi_heap_reservation *res = &heap->reservations[heap->num_reservations++];
+		res->begin = heap->reserve_pos;
+		res->end = heap->reserve_pos;
+	}
+
+	ebi_slab *slab = (ebi_slab*)heap->reserve_pos;
+	heap->reserve_pos += EBI_HEAP_SLAB_SIZE;
+	heap->reservations[heap->num_reservations - 1].end = heap->reserve_pos;
+
+	ebi_mutex_unlock(&heap->reserve_mutex);
+
+	bool ok = ebi_os_commit(slab, EBI_HEAP_SLAB_SIZE);
+	ebi_assert(ok);
+	return slab;
+}
+
+// Give up ownership of `slab` when we have run out of slots in it. Returns
+// `true` if slots were freed concurrently and we took the slab back.
+static bool ebi_heap_detach_slab(ebi_slab *slab)
+{
+	// Pairs with `ebi_heap_free()`: either it sees the slab detached and lists
+	// it or we see the bit it set here.
+	ebi_atomic_xhg32(&slab->state, EBI_SLAB_DETACHED);
+
+	uint32_t any = 0;
+	for (uint32_t i = 0; i < slab->num_masks; i++) {
+		any |= ebi_atomic_load32(&slab->mask[i]);
+	}
+	if (!any) return false;
+
+	return ebi_atomic_cas32(&slab->state, EBI_SLAB_DETACHED, EBI_SLAB_OWNED) == EBI_SLAB_DETACHED;
+}
+
+// Called after freeing a slot in a detached slab, the first thread to get
+// here is responsible for making the slab available again.
+void ebi_heap_slab_freed(ebi_heap *heap, ebi_slab *slab)
+{
+	if (ebi_atomic_cas32(&slab->state, EBI_SLAB_DETACHED, EBI_SLAB_LISTED) == EBI_SLAB_DETACHED) {
+		ebi_ia_push(&heap->partial[slab->cls], slab);
+	}
+}
+
+// Return all cached slots to their slabs, eg. when a thread exits.
+void ebi_heap_flush_cache(ebi_heap_cache *c)
+{
+	ebi_heap *heap = c->heap;
+	for (uint32_t cls = 0; cls < EBI_HEAP_CLASSES; cls++) {
+		ebi_heap_class_cache *cc = &c->classes[cls];
+		ebi_slab *slab = cc->slab;
+		if (!slab) continue;
+
+		const uint8_t *slots = c->slots + ebi_heap_classes[cls].slab_offset;
+		for (uint32_t i = cc->ix; i < cc->count; i++) {
+			uint32_t slot = slots[i];
+			ebi_atomic_or32_release(&slab->mask[slot / 32], 1u << (slot % 32));
+		}
+		uint32_t num_returned = cc->count - cc->ix;
+		ebi_atomic_add64(&heap->freed_bytes, (uint64_t)num_returned * slab->stride);
+
+		if (ebi_heap_detach_slab(slab)) {
+			uint32_t num_free = 0;
+			for (uint32_t i = 0; i < slab->num_masks; i++) {
+				num_free += ebi_popcount32(ebi_atomic_load32(&slab->mask[i]));
+			}
+
+			// Completely free slabs can be reused for any size class
+			if (num_free == ebi_heap_classes[cls].slab_count) {
+				slab->state = EBI_SLAB_EMPTY;
+				slab->idle_cycles = 0;
+				ebi_ia_push(&heap->empty, slab);
+			} else {
+				slab->state = EBI_SLAB_DETACHED;
+				ebi_heap_slab_freed(heap, slab);
+			}
+		}
+
+		cc->slab = NULL;
+		cc->ix = cc->count = 0;
+		cc->fresh = false;
+	}
+}
+
+void ebi_heap_cache_age(ebi_heap_cache *c)
+{
+	for (uint32_t cls = 0; cls < EBI_HEAP_CLASSES; cls++) {
+		c->classes[cls].fresh = false;
+	}
+}
+
+// -- Allocation
+
+// Sweep a slab we are about to allocate from if the current sweep hasn't
+// got to it yet, its memory is going to be touched anyway. Dead objects
+// with weak references need the VM to clean up so those slabs are left to
+// `ebi_gc_sweep()`. Weak bits can't appear on dead objects so checking
+// before the claim is enough.
+static void ebi_heap_sweep_lazy(ebi_heap *heap, ebi_slab *slab)
+{
+	for (uint32_t mi = 0; mi < slab->num_masks; mi++) {
+		if (ebi_atomic_load32_relaxed(&slab->weak_mask[mi])) return;
+	}
+	if (!ebi_heap_sweep_claim_slab(heap, slab)) return;
+
+	uint32_t dead[EBI_SLAB_MAX_MASKS];
+	if (ebi_slab_find_dead(slab, heap->sweep_gen_g, heap->sweep_gen_n, dead)) {
+		ebi_heap_free_slots(heap, slab, dead);
+	}
+}
+
+#define EBI_HEAP_RESERVATION_SLABS (EBI_HEAP_RESERVE_SIZE / EBI_HEAP_SLAB_SIZE)
+
+// Next slab from `lazy_cursor` or NULL if the current sweep has none left.
+static ebi_slab *ebi_heap_lazy_next(ebi_heap *heap)
+{
+	// The set may get reused by the next sweep while we read it, the entry
+	// is only valid if claiming it succeeds, see `ebi_heap_sweep_begin()`.
+	// `num` never exceeds the capacity of the set it is read from.
+	uint64_t epoch = ebi_atomic_load64_acquire(&heap->sweep_cursor) >> 32;
+	ebi_heap_sweep_set *set = *(ebi_heap_sweep_set *volatile*)&heap->sweep_set;
+	if (!set) return NULL;
+	for (;;) {
+		uint64_t cursor = ebi_atomic_load64_acquire(&heap->lazy_cursor);
+		if (cursor >> 32 != epoch) return NULL;
+
+		uint32_t ix = (uint32_t)cursor;
+		size_t ri = ix / EBI_HEAP_RESERVATION_SLABS;
+		if (ri >= *(volatile size_t*)&set->num) return NULL;
+
+		// Skip to the next reservation at the end of this one
+		volatile ebi_heap_reservation *res = &set->reservations[ri];
+		char *begin = res->begin, *end = res->end;
+		char *ptr = begin + (size_t)(ix % EBI_HEAP_RESERVATION_SLABS) * EBI_HEAP_SLAB_SIZE;
+		uint64_t next = cursor + 1;
+		if (ptr + EBI_HEAP_SLAB_SIZE >= end) {
+			next = epoch << 32 | (uint64_t)(ri + 1) * EBI_HEAP_RESERVATION_SLABS;
+		}
+		if (ebi_atomic_cas64(&heap->lazy_cursor, cursor, next) != cursor) continue;
+		if (ptr < end) return (ebi_slab*)ptr;
+	}
+}
+
+// Sweep slabs ahead of the GC until one of class `cls` gets listed with free
+// slots, returns it popped from `ebi_heap.partial`.
+static ebi_slab *ebi_heap_sweep_for_class(ebi_heap *heap, uint32_t cls)
+{
+	for (uint32_t i = 0; i < EBI_HEAP_LAZY_SWEEP_SLABS; i++) {
+		ebi_slab *slab = ebi_heap_lazy_next(heap);
+		if (!slab) break;
+
+		uint32_t state = ebi_atomic_load32_relaxed(&slab->state);
+		if (state == EBI_SLAB_UNUSED || state == EBI_SLAB_EMPTY) continue;
+		ebi_heap_sweep_lazy(heap, slab);
+
+		if (slab->cls == cls) {
+			ebi_slab *listed = (ebi_slab*)ebi_ia_pop(&heap->partial[cls]);
+			if (listed) return listed;
+		}
+	}
+	return NULL;
+}
+
+// Refill the cache of class `cls` and allocate a slot from it.
+// Returns the offset of the slot from the beginning of `slab->data`.
+uint32_t ebi_heap_alloc_slow(ebi_heap_cache *c, uint32_t cls)
+{
+	ebi_heap *heap = c->heap;
+	ebi_heap_class_cache *cc = &c->classes[cls];
+	const ebi_heap_class *hc = &ebi_heap_classes[cls];
+
+	// `ebi_slab_get_free()` may write a few bytes past the slots so decode
+	// to a temporary buffer instead of directly to the cache.
+	uint8_t free_slots[EBI_SLAB_MAX_SLOTS];
+	size_t count = 0;
+
+	// Slots may have been freed in our slab while we were allocating from it
+	ebi_slab *slab = cc->slab;
+	if (slab) {
+		if (heap->lazy_sweep) ebi_heap_sweep_lazy(heap, slab);
+		count = ebi_slab_get_free(slab, free_slots);
+		if (count == 0 && ebi_heap_detach_slab(slab)) {
+			count = ebi_slab_get_free(slab, free_slots);
+		}
+	}
+
+	if (count == 0) {
+		slab = (ebi_slab*)ebi_ia_pop(&heap->partial[cls]);
+		if (!slab && heap->lazy_sweep) slab = ebi_heap_sweep_for_class(heap, cls);
+		if (slab) {
+			// Slabs are only listed after a slot has been freed in them and
+			// only the owner claims slots so this can't come back empty.
+			slab->state = EBI_SLAB_OWNED;
+			if (heap->lazy_sweep) ebi_heap_sweep_lazy(heap, slab);
+			count = ebi_slab_get_free(slab, free_slots);
+			ebi_assert(count > 0);
+		} else {
+			slab = (ebi_slab*)ebi_ia_pop(&heap->empty);
+			if (slab && slab->decommitted) {
+				bool ok = ebi_os_commit((char*)slab + heap->page_size, EBI_HEAP_SLAB_SIZE - heap->page_size);
+				ebi_assert(ok);
+				slab->decommitted = 0;
+			}
+			if (!slab) slab = ebi_heap_carve_slab(heap);
+			ebi_heap_init_slab(heap, slab, cls);
+			count = hc->slab_count;
+			for (uint32_t i = 0; i < count; i++) {
+				free_slots[i] = (uint8_t)i;
+			}
+		}
+	}
+
+	// Everything in a slab that was completely free is ours, refilling the
+	// same slab keeps it that way
+	if (count == hc->slab_count) {
+		cc->fresh = true;
+	} else if (slab != cc->slab) {
+		cc->fresh = false;
+	}
+
+	cc->slab = slab;
+	c->alloc_bytes += count * hc->max_size;
+	ebi_heap_count_alloc(heap, count * hc->max_size);
+
+	memcpy(c->slots + hc->slab_offset, free_slots, count);
+	cc->ix = 1;
+	cc->count = (uint32_t)count;
+	return free_slots[0] * (uint32_t)hc->max_size;
+}
+
+// -- Large objects
+
+void *ebi_heap_alloc_big(ebi_heap_cache *c, size_t size)
+{
+	ebi_heap *heap = c->heap;
+	size_t page_size = heap->page_size;
+	size_t header_size = offsetof(ebi_slab, data) + sizeof(ebi_span);
+	size_t span_size = (header_size + size + page_size - 1) & ~(page_size - 1);
+
+	// Fresh pages from the OS are zeroed, callers can skip clearing them
+	ebi_slab *slab = (ebi_slab*)ebi_os_reserve_aligned(span_size, EBI_HEAP_SLAB_SIZE);
+	if (!slab) return NULL;
+	if (!ebi_os_commit(slab, span_size)) {
+		ebi_os_release(slab, span_size);
+		return NULL;
+	}
+
+	slab->cls = EBI_SLAB_SPAN;
+	slab->stride = 0;
+	slab->slot_mul = 0;
+	slab->num_masks = 1;
+	slab->state = EBI_SLAB_OWNED;
+
+	ebi_span *span = (ebi_span*)slab->data;
+	span->size = span_size;
+
+	ebi_mutex_lock(&heap->span_mutex);
+	span->live_prev = NULL;
+	span->live_next = heap->live_spans;
+	if (heap->live_spans) heap->live_spans->live_prev = span;
+	heap->live_spans = span;
+	heap->span_bytes += span_size;
+	heap->num_spans++;
+	ebi_mutex_unlock(&heap->span_mutex);
+
+	c->alloc_bytes += span_size;
+	ebi_heap_count_alloc(heap, span_size);
+	return span + 1;
+}
+
+// Unmapping is deferred to `ebi_heap_release_spans()` so sweeping threads
+// don't have to do system calls or contend on `span_mutex`.
+void ebi_heap_free_big(ebi_heap *heap, ebi_slab *slab)
+{
+	ebi_atomic_add64(&heap->freed_bytes, ((ebi_span*)slab->data)->size);
+	ebi_ia_push(&heap->dead_spans, slab);
+}
+
+// Return the memory of dead spans to the OS, called after sweep.
+void ebi_heap_release_spans(ebi_heap *heap)
+{
+	ebi_slab *slab = (ebi_slab*)ebi_ia_pop_all(&heap->dead_spans);
+	if (!slab) return;
+
+	ebi_mutex_lock(&heap->span_mutex);
+	for (ebi_slab *sl = slab; sl; sl = sl->next) {
+		ebi_span *s = (ebi_span*)sl->data;
+		if (s->live_prev) {
+			s->live_prev->live_next = s->live_next;
+		} else {
+			heap->live_spans = s->live_next;
+		}
+		if (s->live_next) s->live_next->live_prev = s->live_prev;
+		heap->span_bytes -= s->size;
+		heap->num_spans--;
+	}
+	ebi_mutex_unlock(&heap->span_mutex);
+
+	while (slab) {
+		ebi_slab *next = slab->next;
+		ebi_span *span = (ebi_span*)slab->data;
+		ebi_os_release(slab, span->size);
+		slab = next;
+	}
+}
+
+// -- Scavenging
+
+static bool ebi_heap_slab_is_empty(ebi_slab *slab)
+{
+	uint32_t num_free = 0;
+	for (uint32_t i = 0; i < slab->num_masks; i++) {
+		num_free += ebi_popcount32(ebi_atomic_load32_relaxed(&slab->mask[i]));
+	}
+	return num_free == ebi_heap_classes[slab->cls].slab_count;
+}
+
+// Return memory of empty slabs that have been idle for a while to the OS.
+// Called by the GC once per cycle after sweeping.
+//
+// Sweeping lists slabs in `partial` as soon as one slot is freed, so first
+// move the completely free ones to `empty`. Nobody else can claim slots of a
+// listed slab so once it's empty it stays that way. Then keep the most
+// recently emptied `scavenge_reserve` slabs warm and decommit the rest after
+// they have been idle for `scavenge_cycles` cycles. The first page holding
+// the header is never decommitted so the lists and `ebi_heap_get_stats()`
+// don't fault the memory back in.
+void ebi_heap_scavenge(ebi_heap *heap)
+{
+	// Decommitting part of a huge page would split it, so huge page backed
+	// heaps trade the memory for TLB reach and only reuse empty slabs.
+	size_t page_size = heap->page_size;
+	bool can_decommit = page_size < EBI_HEAP_SLAB_SIZE && !heap->huge_pages;
+
+	ebi_slab *fresh = NULL, *fresh_tail = NULL;
+	for (uint32_t cls = 0; cls < EBI_HEAP_CLASSES; cls++) {
+		ebi_slab *slab = (ebi_slab*)ebi_ia_pop_all(&heap->partial[cls]);
+		while (slab) {
+			ebi_slab *next = slab->next;
+			if (ebi_heap_slab_is_empty(slab)) {
+				slab->state = EBI_SLAB_EMPTY;
+				slab->idle_cycles = 0;
+				slab->next = NULL;
+				if (fresh_tail) fresh_tail->next = slab;
+				else fresh = slab;
+				fresh_tail = slab;
+			} else {
+				ebi_ia_push(&heap->partial[cls], slab);
+			}
+			slab = next;
+		}
+	}
+
+	// `empty` is LIFO so the slabs are roughly ordered from the most recently
+	// emptied to the oldest, newly emptied slabs go in front of them.
+	ebi_slab *slab = (ebi_slab*)ebi_ia_pop_all(&heap->empty);
+	if (fresh) {
+		fresh_tail->next = slab;
+		slab = fresh;
+	}
+
+	// Collect the slabs in reverse so that pushing them back restores the
+	// order, decommitted slabs go to the bottom of the stack.
+	ebi_slab *warm = NULL, *cold = NULL;
+	size_t num_warm = 0;
+	while (slab) {
+		ebi_slab *next = slab->next;
+		if (!slab->decommitted) {
+			if (!can_decommit || num_warm < heap->scavenge_reserve || slab->idle_cycles < heap->scavenge_cycles) {
+				num_warm++;
+			} else {
+				ebi_os_decommit((char*)slab + page_size, EBI_HEAP_SLAB_SIZE - page_size);
+				slab->decommitted = 1;
+			}
+		}
+		if (slab->idle_cycles < UINT16_MAX) slab->idle_cycles++;
+
+		if (slab->decommitted) {
+			slab->next = cold;
+			cold = slab;
+		} else {
+			slab->next = warm;
+			warm = slab;
+		}
+		slab = next;
+	}
+
+	while (cold) {
+		ebi_slab *next = cold->next;
+		ebi_ia_push(&heap->empty, cold);
+		cold = next;
+	}
+	while (warm) {
+		ebi_slab *next = warm->next;
+		ebi_ia_push(&heap->empty, warm);
+		warm = next;
+	}
+}
+
+// -- Sweeping
+
+#define EBI_HEAP_SWEEP_RESERVATION_CHUNKS (EBI_HEAP_RESERVE_SIZE / EBI_HEAP_SLAB_SIZE / EBI_HEAP_SWEEP_CHUNK)
+
+// Snapshot the carved slabs, ones carved later only contain objects that
+// were allocated during this cycle. Call from the GC thread once the previous
+// sweep is done.
+void ebi_heap_sweep_begin(ebi_heap *heap, uint8_t gen_g, uint8_t gen_n)
+{
+	// Lazy sweepers of the previous sweep may be reading the set: close the
+	// cursor with a read-modify-write so that any claim that succeeded before
+	// it also finished reading, later ones fail and discard what they read.
+	uint64_t cursor = ebi_atomic_load64_relaxed(&heap->lazy_cursor);
+	for (;;) {
+		uint64_t closed = cursor | UINT32_MAX;
+		uint64_t prev = ebi_atomic_cas64(&heap->lazy_cursor, cursor, closed);
+		if (prev == cursor) break;
+		cursor = prev;
+	}
+
+	ebi_mutex_lock(&heap->reserve_mutex);
+	size_t num = heap->num_reservations;
+	ebi_heap_sweep_set *set = heap->sweep_set;
+	if (!set || num > set->capacity) {
+		size_t capacity = heap->max_reservations;
+		ebi_heap_sweep_set *grown = (ebi_heap_sweep_set*)malloc(sizeof(ebi_heap_sweep_set) + capacity * sizeof(ebi_heap_reservation));
+		ebi_assert(grown);
+		grown->retired = set;
+		grown->num = 0;
+		grown->capacity = capacity;
+		set = grown;
+	}
+	if (num) memcpy(set->reservations, heap->reservations, num * sizeof(ebi_heap_reservation));
+	set->num = num;
+	ebi_mutex_unlock(&heap->reserve_mutex);
+
+	// One extra chunk for the large object spans
+	*(volatile ebi_heap_sweep_set**)&heap->sweep_set = set;
+	*(volatile uint32_t*)&heap->sweep_num_chunks = (uint32_t)(num * EBI_HEAP_SWEEP_RESERVATION_CHUNKS) + 1;
+	ebi_atomic_store32_relaxed(&heap->sweep_done, 0);
+	heap->sweep_gen_g = gen_g;
+	heap->sweep_gen_n = gen_n;
+
+	// Publishes the generations and the lazy cursor to allocating threads
+	uint64_t epoch = (ebi_atomic_load64_relaxed(&heap->sweep_cursor) >> 32) + 1;
+	ebi_atomic_store64_relaxed(&heap->lazy_cursor, epoch << 32);
+	ebi_atomic_store64_release(&heap->sweep_cursor, epoch << 32);
+}
+
+bool ebi_heap_sweep_claim(ebi_heap *heap, ebi_heap_sweep_chunk *chunk)
+{
+	uint32_t ix;
+	for (;;) {
+		uint64_t cursor = ebi_atomic_load64_acquire(&heap->sweep_cursor);
+		ix = (uint32_t)cursor;
+		if (ix >= *(volatile uint32_t*)&heap->sweep_num_chunks) return false;
+		if (ebi_atomic_cas64(&heap->sweep_cursor, cursor, cursor + 1) == cursor) break;
+	}
+
+	chunk->begin = chunk->end = NULL;
+	chunk->spans = ix == heap->sweep_num_chunks - 1;
+	if (!chunk->spans) {
+		ebi_heap_reservation *res = &heap->sweep_set->reservations[ix / EBI_HEAP_SWEEP_RESERVATION_CHUNKS];
+		size_t offset = (size_t)(ix % EBI_HEAP_SWEEP_RESERVATION_CHUNKS) * EBI_HEAP_SWEEP_CHUNK * EBI_HEAP_SLAB_SIZE;
+		size_t size = (size_t)(res->end - res->begin);
+		if (offset < size) {
+			chunk->begin = res->begin + offset;
+			chunk->end = size - offset > EBI_HEAP_SWEEP_CHUNK * EBI_HEAP_SLAB_SIZE
+				? chunk->begin + EBI_HEAP_SWEEP_CHUNK * EBI_HEAP_SLAB_SIZE : res->end;
+		}
+	}
+	return true;
+}
+
+// Claim `slab` for sweeping in the current sweep. Returns `false` if it has
+// already been swept, either by a chunk or by `ebi_heap_alloc_slow()`.
+bool ebi_heap_sweep_claim_slab(ebi_heap *heap, ebi_slab *slab)
+{
+	uint32_t epoch = (uint32_t)(ebi_atomic_load64_acquire(&heap->sweep_cursor) >> 32);
+	uint32_t prev = ebi_atomic_load32_relaxed(&slab->sweep_epoch);
+	if (prev == epoch) return false;
+	return ebi_atomic_cas32(&slab->sweep_epoch, prev, epoch) == prev;
+}
+
+void ebi_heap_sweep_finish(ebi_heap *heap)
+{
+	ebi_atomic_add32(&heap->sweep_done, 1);
+}
+
+bool ebi_heap_sweep_done(ebi_heap *heap)
+{
+	return ebi_atomic_load32_acquire(&heap->sweep_done) == *(volatile uint32_t*)&heap->sweep_num_chunks;
+}
+
+#if EBI_CPU_X86
+
+// Compare 16 generations at a time: G objects (`gen_g != 0`) are dead if
+// `gen_g` is behind the current one and N objects if `gen_n` is. Free slots
+// have both zero and are never dead.
+static ebi_target("sse2") bool ebi_slab_find_dead_sse2(const ebi_slab *slab, uint8_t gen_g, uint8_t gen_n, uint32_t *dead)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i cur_g = _mm_set1_epi8((char)gen_g);
+	const __m128i cur_n = _mm_set1_epi8((char)gen_n);
+	uint32_t any = 0;
+	for (uint32_t mi = 0; mi < slab->num_masks; mi++) {
+		uint32_t mask = 0;
+		for (uint32_t half = 0; half < 2; half++) {
+			uint32_t base = mi * 32 + half * 16;
+			__m128i g = _mm_load_si128((const __m128i*)(slab->gen_g + base));
+			__m128i n = _mm_load_si128((const __m128i*)(slab->gen_n + base));
+			__m128i is_n = _mm_cmpeq_epi8(g, zero);
+			__m128i old_g = _mm_cmplt_epi8(_mm_sub_epi8(g, cur_g), zero);
+			__m128i old_n = _mm_cmplt_epi8(_mm_sub_epi8(n, cur_n), zero);
+			__m128i used_n = _mm_andnot_si128(_mm_cmpeq_epi8(n, zero), is_n);
+			__m128i d = _mm_or_si128(_mm_andnot_si128(is_n, old_g), _mm_and_si128(used_n, old_n));
+			mask |= (uint32_t)_mm_movemask_epi8(d) << (half * 16);
+		}
+		dead[mi] = mask;
+		any |= mask;
+	}
+	return any != 0;
+}
+
+#endif
+
+bool ebi_slab_find_dead(const ebi_slab *slab, uint8_t gen_g, uint8_t gen_n, uint32_t *dead)
+{
+#if EBI_CPU_X86
+	return ebi_slab_find_dead_sse2(slab, gen_g, gen_n, dead);
+#else
+	uint32_t any = 0;
+	for (uint32_t mi = 0; mi < slab->num_masks; mi++) {
+		uint32_t mask = 0;
+		for (uint32_t i = 0; i < 32; i++) {
+			uint8_t g = slab->gen_g[mi * 32 + i], n = slab->gen_n[mi * 32 + i];
+			bool old = g ? (uint8_t)(g - gen_g) >= 128 : n && (uint8_t)(n - gen_n) >= 128;
+			mask |= (uint32_t)old << i;
+		}
+		dead[mi] = mask;
+		any |= mask;
+	}
+	return any != 0;
+#endif
+}
+
+void ebi_heap_free_slots(ebi_heap *heap, ebi_slab *slab, const uint32_t *dead)
+{
+	// Slots may be reused as soon as they are in `mask`, clear first
+	uint32_t num_masks = slab->num_masks;
+	for (uint32_t mi = 0; mi < num_masks; mi++) {
+		uint32_t mask = dead[mi];
+		while (mask) {
+			uint32_t slot = mi * 32 + ebi_bsf32(mask);
+			slab->gen_g[slot] = 0;
+			slab->gen_n[slot] = 0;
+			mask &= mask - 1;
+		}
+	}
+
+	uint32_t num_dead = 0;
+	for (uint32_t mi = 0; mi < num_masks; mi++) {
+		num_dead += ebi_popcount32(dead[mi]);
+	}
+	ebi_atomic_add64(&heap->freed_bytes, (uint64_t)num_dead * slab->stride);
+
+	// Same protocol as `ebi_heap_free()`
+	for (uint32_t mi = 0; mi < num_masks; mi++) {
+		if (slab->pin_mask[mi] & dead[mi]) ebi_atomic_and32(&slab->pin_mask[mi], ~dead[mi]);
+		if (dead[mi]) ebi_atomic_or32(&slab->mask[mi], dead[mi]);
+	}
+	if (ebi_atomic_load32(&slab->state) == EBI_SLAB_DETACHED) {
+		ebi_heap_slab_freed(heap, slab);
+	}
+}
+
+// -- Evacuation
+
+typedef struct {
+	ebi_slab *slab;
+	uint32_t num_live;
+} ebi_heap_evacuee;
+
+static int ebi_heap_evacuee_cmp(const void *a, const void *b)
+{
+	uint32_t la = ((const ebi_heap_evacuee*)a)->num_live;
+	uint32_t lb = ((const ebi_heap_evacuee*)b)->num_live;
+	return la < lb ? -1 : la > lb ? 1 : 0;
+}
+
+// Pick the sparsest partial slabs to evacuate, called by the GC after sweep.
+// Slabs with pinned objects are left alone as they could never become empty.
+// Taken slabs are out of reach of allocating threads until they are ended.
+ebi_slab *ebi_heap_evacuate_begin(ebi_heap *heap)
+{
+	if (heap->evacuate_bytes == 0) return NULL;
+
+	ebi_heap_evacuee *evacuees = NULL;
+	size_t num_evacuees = 0, max_evacuees = 0;
+	for (uint32_t cls = 0; cls < EBI_HEAP_CLASSES; cls++) {
+		uint32_t slab_count = ebi_heap_classes[cls].slab_count;
+		uint32_t max_live = (uint32_t)(heap->evacuate_occupancy * (double)slab_count);
+		ebi_slab *slab = (ebi_slab*)ebi_ia_pop_all(&heap->partial[cls]);
+		while (slab) {
+			ebi_slab *next = slab->next;
+			uint32_t num_free = 0, num_pinned = 0;
+			for (uint32_t i = 0; i < slab->num_masks; i++) {
+				uint32_t mask = ebi_atomic_load32_relaxed(&slab->mask[i]);
+				num_free += ebi_popcount32(mask);
+				num_pinned += ebi_popcount32(slab->pin_mask[i] & ~mask);
+			}
+			uint32_t num_live = slab_count - num_free;
+			if (num_live > 0 && num_live <= max_live && num_pinned == 0) {
+				if (num_evacuees == max_evacuees) {
+					max_evacuees = max_evacuees ? max_evacuees * 2 : 64;
+					evacuees = (ebi_heap_evacuee*)realloc(evacuees, max_evacuees * sizeof(ebi_heap_evacuee));
+					ebi_assert(evacuees);
+				}
+				evacuees[num_evacuees].slab = slab;
+				evacuees[num_evacuees].num_live = num_live;
+				num_evacuees++;
+			} else {
+				ebi_ia_push(&heap->partial[cls], slab);
+			}
+			slab = next;
+		}
+	}
+
+	qsort(evacuees, num_evacuees, sizeof(ebi_heap_evacuee), &ebi_heap_evacuee_cmp);
+
+	ebi_slab *slabs = NULL;
+	size_t bytes = 0;
+	for (size_t i = 0; i < num_evacuees; i++) {
+		ebi_slab *slab = evacuees[i].slab;
+		size_t live_bytes = (size_t)evacuees[i].num_live * slab->stride;
+		if (bytes + live_bytes <= heap->evacuate_bytes) {
+			bytes += live_bytes;
+			slab->state = EBI_SLAB_EVACUATING;
+			slab->next = slabs;
+			slabs = slab;
+		} else {
+			ebi_ia_push(&heap->partial[slab->cls], slab);
+		}
+	}
+
+	free(evacuees);
+	return slabs;
+}
+
+// Return evacuated slabs to the partial lists, the ones that are now empty
+// are moved to `empty` by the next `ebi_heap_scavenge()`.
+void ebi_heap_evacuate_end(ebi_heap *heap, ebi_slab *slabs)
+{
+	while (slabs) {
+		ebi_slab *next = slabs->next;
+		slabs->state = EBI_SLAB_LISTED;
+		ebi_ia_push(&heap->partial[slabs->cls], slabs);
+		slabs = next;
+	}
+}
+
+// -- Statistics
+
+// Scan the headers of all carved slabs without stopping anyone. Slots cached
+// by threads are not visible here and are counted as live.
+void ebi_heap_get_stats(ebi_heap *heap, ebi_heap_stats *stats)
+{
+	memset(stats, 0, sizeof(ebi_heap_stats));
+	stats->num_classes = EBI_HEAP_CLASSES;
+	for (uint32_t cls = 0; cls < EBI_HEAP_CLASSES; cls++) {
+		stats->classes[cls].slot_size = ebi_heap_classes[cls].max_size;
+	}
+
+	// Copy the reservation bounds so we don't block threads carving new
+	// slabs while scanning. Reservations are never released.
+	ebi_mutex_lock(&heap->reserve_mutex);
+	size_t num_reservations = heap->num_reservations;
+	size_t reservations_size = num_reservations * sizeof(ebi_heap_reservation);
+	ebi_heap_reservation *reservations = (ebi_heap_reservation*)malloc(reservations_size ? reservations_size : 1);
+	ebi_assert(reservations);
+	if (num_reservations) memcpy(reservations, heap->reservations, reservations_size);
+	ebi_mutex_unlock(&heap->reserve_mutex);
+
+	for (size_t ri = 0; ri < num_reservations; ri++) {
+		ebi_heap_reservation res = reservations[ri];
+		for (char *pos = res.begin; pos != res.end; pos += EBI_HEAP_SLAB_SIZE) {
+			ebi_slab *slab = (ebi_slab*)pos;
+			uint32_t state = ebi_atomic_load32_relaxed(&slab->state);
+			uint32_t cls = *(volatile uint8_t*)&slab->cls;
+			stats->slab_bytes += EBI_HEAP_SLAB_SIZE;
+
+			if (state == EBI_SLAB_UNUSED || state == EBI_SLAB_EMPTY || cls >= EBI_HEAP_CLASSES) {
+				stats->num_empty_slabs++;
+				if (*(volatile uint16_t*)&slab->decommitted) stats->num_decommitted_slabs++;
+				continue;
+			}
+
+			uint32_t num_free = 0;
+			for (uint32_t i = 0; i < EBI_SLAB_MAX_MASKS; i++) {
+				num_free += ebi_popcount32(ebi_atomic_load32_relaxed(&slab->mask[i]));
+			}
+
+			uint32_t slab_count = ebi_heap_classes[cls].slab_count;
+			if (num_free > slab_count) num_free = slab_count;
+
+			ebi_heap_class_stats *cs = &stats->classes[cls];
+			cs->num_slabs++;
+			cs->free_slots += num_free;
+			cs->live_slots += slab_count - num_free;
+		}
+	}
+	free(reservations);
+
+	ebi_mutex_lock(&heap->span_mutex);
+	stats->large_bytes = heap->span_bytes;
+	stats->num_large_objects = heap->num_spans;
+	ebi_mutex_unlock(&heap->span_mutex);
+}
@@ -1,12 +1,21 @@
 #ifndef EBI_HEAP_H
 #define EBI_HEAP_H
 
-#include "ebi_platform.h"
+#include "ebi_intrin.h"
+#include "ebi_sync.h"
+#include "ebi_core.h"
+
+#include <stddef.h>
 
 typedef struct ebi_slab ebi_slab;
 typedef struct ebi_heap_class ebi_heap_class;
 typedef struct ebi_heap_class_cache ebi_heap_class_cache;
 typedef struct ebi_heap_cache ebi_heap_cache;
+typedef struct ebi_heap ebi_heap;
+typedef struct ebi_span ebi_span;
+typedef struct ebi_heap_reservation ebi_heap_reservation;
+typedef struct ebi_heap_sweep_chunk ebi_heap_sweep_chunk;
+typedef struct ebi_heap_sweep_set ebi_heap_sweep_set;
 
 struct ebi_heap_class {
 	uint16_t max_size;
@@ -16,65 +25,327 @@ struct ebi_heap_class {
 #define EBI_HEAP_MAX_CLASS_SIZE 2048
 
 // Generated by misc/make_heap_sizes.py
-#define EBI_HEAP_CLASSES 22
-#define EBI_HEAP_SLAB_MASKS 10000000 // TODO
+#define EBI_HEAP_CLASSES 25
+#define EBI_HEAP_GRANULARITY 8
+#define EBI_HEAP_SLAB_OFFSETS 1950
 
 extern const ebi_heap_class ebi_heap_classes[EBI_HEAP_CLASSES];
-extern const uint8_t ebi_heap_size_to_class[128];
+extern const uint8_t ebi_heap_size_to_class[256];
+
+#define EBI_HEAP_SLAB_SIZE (16*1024)
+#define EBI_HEAP_RESERVE_SIZE (64*1024*1024)
+#define EBI_HEAP_HUGE_PAGE_SIZE (2*1024*1024)
+
+#define EBI_HEAP_DEFAULT_SCAVENGE_RESERVE 256
+#define EBI_HEAP_DEFAULT_SCAVENGE_CYCLES 4
+
+// Maximum number of slots in a slab, buffers passed to `ebi_slab_get_free()`
+// must have space for this many entries. Matches `max_slab_count` in
+// misc/make_heap_sizes.py.
+#define EBI_SLAB_MAX_SLOTS (4 * 32)
+#define EBI_SLAB_MAX_MASKS (EBI_SLAB_MAX_SLOTS / 32)
 
+// `cls` of spans holding a single large object
+#define EBI_SLAB_SPAN 0xffu
+
+typedef enum ebi_slab_state {
+	EBI_SLAB_UNUSED,   // Carved but not initialized yet
+	EBI_SLAB_OWNED,    // Allocated from by a thread
+	EBI_SLAB_DETACHED, // Fully allocated and not owned by anyone
+	EBI_SLAB_LISTED,   // In one of the `ebi_heap.partial` lists
+	EBI_SLAB_EMPTY,    // In the `ebi_heap.empty` list
+	EBI_SLAB_EVACUATING, // Being emptied by the GC, see `ebi_heap_evacuate_begin()`
+} ebi_slab_state;
+
+// Slabs are split into equally sized slots of a single size class. Set bits
+// in `mask` are free slots: threads that own the slab claim them all at once
+// and anyone can free a slot by setting its bit.
+//
+// Slabs are aligned to `EBI_HEAP_SLAB_SIZE` so the slab of any object can be
+// found from its address. Per-object GC state lives in side arrays indexed
+// by slot instead of in the objects.
 struct ebi_slab {
-	ebi_slab *next;
-	char align[16 - sizeof(ebi_slab*)];
-	uint32_t mask[8];
-	uint32_t num_masks;
-	uint32_t pad[3];
+	union {
+		ebi_slab *next;
+		uint64_t next_bits; // Same layout for 32-bit pointers
+	};
+	uint16_t idle_cycles; // Scavenges spent in `ebi_heap.empty`
+	uint16_t decommitted; // Pages after the first one returned to the OS
+	uint32_t slot_mul; // `ceil(2^32 / stride)`, zero for spans
+	uint32_t mask[EBI_SLAB_MAX_MASKS];
+	uint8_t num_masks;
+	uint8_t cls;       // Size class or `EBI_SLAB_SPAN`
+	uint16_t stride;
+	uint32_t state;    // `ebi_slab_state`
+	uint32_t sweep_epoch; // Last sweep that claimed the slab, see `ebi_heap_sweep_claim_slab()`
+	uint32_t cards;    // Dirty cards of the GC remembered set, see `ebi_gc_dirty_card()`
+	uint32_t weak_mask[EBI_SLAB_MAX_MASKS]; // Slots that have an entry in the VM weak table
+	uint32_t pin_mask[EBI_SLAB_MAX_MASKS];  // Slots that evacuation must not move
+
+	// Generation bytes of the objects, see `ebi_gc_gen`. Both are zero for
+	// slots that are not allocated.
+	uint8_t gen_g[EBI_SLAB_MAX_SLOTS];
+	uint8_t gen_n[EBI_SLAB_MAX_SLOTS];
+
 	char data[EBI_FLEXIBLE_ARRAY];
 };
 
+// Matches `slab_header_bytes` in misc/make_heap_sizes.py
+#define EBI_SLAB_HEADER_SIZE 336
+
+// Allocations larger than `EBI_HEAP_MAX_CLASS_SIZE` get their own slab
+// aligned span of virtual memory. Spans start with a slab header with a
+// single slot so objects in them can be treated the same as ones in slabs,
+// this follows in `data` with the object right after it.
+struct ebi_span {
+	ebi_span *live_prev, *live_next;
+	size_t size; // Mapped size in bytes including the headers
+	char pad[16 - sizeof(size_t)];
+};
+
+// Address space reserved for slabs, slabs are carved from `begin` to `end`.
+struct ebi_heap_reservation {
+	char *begin, *end;
+};
+
+// Reservations snapshotted by `ebi_heap_sweep_begin()`. Allocating threads
+// may still be reading the set of the previous sweep when the next one
+// begins so sets are never freed, only replaced by larger ones.
+struct ebi_heap_sweep_set {
+	ebi_heap_sweep_set *retired; // Smaller set this one replaced
+	size_t num, capacity;
+	ebi_heap_reservation reservations[EBI_FLEXIBLE_ARRAY];
+};
+
+// Part of the heap claimed by a sweeping thread, either a range of slabs or
+// all of the large object spans.
+struct ebi_heap_sweep_chunk {
+	char *begin, *end;
+	bool spans;
+};
+
+// Slabs per sweep chunk
+#define EBI_HEAP_SWEEP_CHUNK 64
+
+// Slabs an allocating thread sweeps looking for free slots before it gives
+// up and takes an empty slab
+#define EBI_HEAP_LAZY_SWEEP_SLABS 16
+
+// VM-wide slab manager. Threads only touch this when they run out of slots
+// in their current slab.
+struct ebi_heap {
+	ebi_ia_stack partial[EBI_HEAP_CLASSES]; // Slabs with free slots per class
+	ebi_ia_stack empty;                     // Completely free slabs
+
+	// Current virtual memory reservation new slabs are carved from
+	ebi_mutex reserve_mutex;
+	char *reserve_pos, *reserve_end;
+
+	// Align new reservations to `EBI_HEAP_HUGE_PAGE_SIZE` and ask for them
+	// to be backed by transparent huge pages
+	bool huge_pages;
+
+	// All reservations, the `end` of the last one is `reserve_pos`
+	ebi_heap_reservation *reservations;
+	size_t num_reservations, max_reservations;
+
+	// Slabs carved before `ebi_heap_sweep_begin()`, swept in chunks.
+	// `sweep_cursor` is the next chunk in the low bits and an epoch in the
+	// high bits so claims from a previous sweep can't succeed. Objects older
+	// than `sweep_gen_g` or `sweep_gen_n` are dead.
+	ebi_heap_sweep_set *sweep_set;
+	uint32_t sweep_num_chunks;
+	uint32_t sweep_done;
+	uint64_t sweep_cursor;
+	uint8_t sweep_gen_g, sweep_gen_n;
+
+	// Let `ebi_heap_alloc_slow()` sweep slabs it is about to reuse, and scan
+	// for slabs to sweep from `lazy_cursor` before taking an empty one. The
+	// cursor is a slab index in the low bits in the same layout as chunks.
+	bool lazy_sweep;
+	uint64_t lazy_cursor;
+
+	// Major GCs move the live objects out of the sparsest partial slabs
+	// with at most `evacuate_occupancy` of their slots in use, copying up to
+	// `evacuate_bytes` per cycle. Zero bytes disables evacuation.
+	double evacuate_occupancy;
+	size_t evacuate_bytes;
+
+	// Allocation volume for GC pacing: bytes handed to thread caches and
+	// large objects, and bytes freed by sweeping or returned from caches.
+	// `alloc_fence` is opened when `alloc_bytes` reaches `alloc_trigger`.
+	uint64_t alloc_bytes;
+	uint64_t freed_bytes;
+	uint64_t alloc_trigger;
+	ebi_fence alloc_fence;
+
+	// Empty slabs beyond `scavenge_reserve` are decommitted after spending
+	// `scavenge_cycles` GC cycles in `empty`
+	size_t scavenge_reserve;
+	uint32_t scavenge_cycles;
+
+	// Large object spans, dead spans are unmapped after sweep. The list
+	// links the slab headers of the spans.
+	ebi_ia_stack dead_spans;
+	ebi_mutex span_mutex;
+	ebi_span *live_spans;
+	size_t span_bytes;
+	size_t num_spans;
+	size_t page_size;
+};
+
+// Per-thread state of a size class: `slots[slab_offset + ix]` up to `count`
+// are free slot indices of `slab` claimed by this thread. Each class has room
+// for `slab_count` indices so the whole cache is only a couple of KiB.
+// `fresh` is set if `slab` was completely free when it was claimed after the
+// last `ebi_heap_cache_age()`, so all objects in it have been allocated since.
 struct ebi_heap_class_cache {
 	ebi_slab *slab;
-	uint32_t offset;
 	uint32_t ix;
+	uint32_t count;
+	bool fresh;
 };
 
+// Thread local allocation cache, zero initialized with `heap` set is a valid
+// empty state. Classes are populated lazily on their first allocation.
 struct ebi_heap_cache {
+	ebi_heap *heap;
+	uint64_t alloc_bytes; // Total bytes claimed by refills and large objects
 	ebi_heap_class_cache classes[EBI_HEAP_CLASSES];
-	uint32_t masks[EBI_HEAP_SLAB_MASKS];
+	uint8_t slots[EBI_HEAP_SLAB_OFFSETS];
 };
 
-size_t ebi_slab_get_free(const ebi_slab *slab, uint8_t *dst);
+typedef enum ebi_slab_decoder {
+	EBI_SLAB_DECODE_SWAR,
+	EBI_SLAB_DECODE_AVX2,
+	EBI_SLAB_DECODE_AVX512_VBMI2,
+
+	EBI_SLAB_DECODE_COUNT,
+} ebi_slab_decoder;
+
+size_t ebi_slab_get_free(ebi_slab *slab, uint8_t *dst);
+
+// Expand free `masks` to a list of slot indices using a specific decoder,
+// `ebi_slab_get_free()` picks the best supported one at runtime.
+bool ebi_slab_decoder_supported(ebi_slab_decoder decoder);
+size_t ebi_slab_decode(ebi_slab_decoder decoder, const uint32_t *masks, uint32_t num_masks, uint8_t *dst);
 
-uint32_t ebi_heap_alloc_slow(ebi_heap_cache *c, uint32_t cls, uint32_t ix);
+void ebi_heap_init(ebi_heap *heap);
+void ebi_heap_init_cache(ebi_heap_cache *c, ebi_heap *heap);
+void ebi_heap_flush_cache(ebi_heap_cache *c);
+
+// Forget which objects are fresh, see `ebi_heap_cache_is_fresh()`.
+void ebi_heap_cache_age(ebi_heap_cache *c);
+
+uint32_t ebi_heap_alloc_slow(ebi_heap_cache *c, uint32_t cls);
 void *ebi_heap_alloc_big(ebi_heap_cache *c, size_t size);
+void ebi_heap_free_big(ebi_heap *heap, ebi_slab *slab);
+void ebi_heap_release_spans(ebi_heap *heap);
+void ebi_heap_scavenge(ebi_heap *heap);
+void ebi_heap_slab_freed(ebi_heap *heap, ebi_slab *slab);
+
+void ebi_heap_get_stats(ebi_heap *heap, ebi_heap_stats *stats);
+
+// Sweeping: the GC calls `ebi_heap_sweep_begin()` after which any thread can
+// claim chunks until `ebi_heap_sweep_claim()` returns false. Each claimed
+// chunk must be finished with `ebi_heap_sweep_finish()`. Slabs in a chunk
+// must be claimed with `ebi_heap_sweep_claim_slab()` as allocating threads
+// may have swept them already.
+void ebi_heap_sweep_begin(ebi_heap *heap, uint8_t gen_g, uint8_t gen_n);
+bool ebi_heap_sweep_claim(ebi_heap *heap, ebi_heap_sweep_chunk *chunk);
+bool ebi_heap_sweep_claim_slab(ebi_heap *heap, ebi_slab *slab);
+void ebi_heap_sweep_finish(ebi_heap *heap);
+bool ebi_heap_sweep_done(ebi_heap *heap);
 
+// Set bits in `dead[num_masks]` for allocated slots with a generation older
+// than `gen_g` or `gen_n`. Returns `true` if there are any.
+bool ebi_slab_find_dead(const ebi_slab *slab, uint8_t gen_g, uint8_t gen_n, uint32_t *dead);
+
+// Free all slots in `dead[num_masks]` at once.
+void ebi_heap_free_slots(ebi_heap *heap, ebi_slab *slab, const uint32_t *dead);
+
+// Evacuation: `ebi_heap_evacuate_begin()` takes the slabs to evacuate off the
+// partial lists and returns them linked through `next`. The caller moves the
+// objects and frees their slots, then returns the slabs to the heap with
+// `ebi_heap_evacuate_end()`.
+ebi_slab *ebi_heap_evacuate_begin(ebi_heap *heap);
+void ebi_heap_evacuate_end(ebi_heap *heap, ebi_slab *slabs);
+
+// Slab or span containing `ptr`.
+static ebi_forceinline ebi_slab *
+ebi_heap_get_slab(const void *ptr)
+{
+	return (ebi_slab*)((uintptr_t)ptr & ~(uintptr_t)(EBI_HEAP_SLAB_SIZE - 1));
+}
+
+// Slot index of `ptr` in `slab`, divides by the stride with a multiply.
+// Exact as offsets are less than 2^14 and the error of `slot_mul` is less
+// than the stride which is less than 2^12. Always zero in spans.
+static ebi_forceinline uint32_t
+ebi_slab_get_slot(const ebi_slab *slab, const void *ptr)
+{
+	uint32_t offset = (uint32_t)((const char*)ptr - slab->data);
+	return (uint32_t)(((uint64_t)offset * slab->slot_mul) >> 32);
+}
+
+// Returns `true` if the objects in `slab` were allocated from this cache after
+// the last `ebi_heap_cache_age()`. Misses objects in slabs that had live
+// objects when the cache claimed them so it's only a hint that an object is new.
+static ebi_forceinline bool
+ebi_heap_cache_is_fresh(const ebi_heap_cache *c, const ebi_slab *slab)
+{
+	uint32_t cls = slab->cls;
+	if (cls >= EBI_HEAP_CLASSES) return false;
+	const ebi_heap_class_cache *cc = &c->classes[cls];
+	return cc->slab == slab && cc->fresh;
+}
+
+// Allocate `size` bytes.
 static ebi_forceinline void *
-ebi_heap_alloc(ebi_heap_cache *c, size_t size, uint32_t *header_offset)
+ebi_heap_alloc(ebi_heap_cache *c, size_t size)
 {
 	if (size <= EBI_HEAP_MAX_CLASS_SIZE) {
-		const uint32_t cls = ebi_heap_size_to_class[(size - 1) / 16];
-		const uint32_t stride = ebi_heap_classes[cls].max_size;
+		const uint32_t cls = ebi_heap_size_to_class[(size - 1) / EBI_HEAP_GRANULARITY];
+		const ebi_heap_class *hc = &ebi_heap_classes[cls];
 		ebi_heap_class_cache *cc = &c->classes[cls];
-		ebi_slab *slab = cc->slab;
 		const uint32_t ix = cc->ix;
-		uint32_t offset = cc->offset;
-		const uint32_t mask = c->masks[ix];
-		const uint32_t next = ebi_bsf32(mask);
-		const uint32_t next_mask = mask & (mask - 1);
-
-		cc->offset = next * stride;
-		cc->ix = ix + (next_mask == 0);
-		c->masks[ix] = next_mask;
-
-		if ((mask | ix) == 0) {
-			offset = ebi_heap_alloc_slow(c, cls, ix);
-			slab = cc->slab;
+
+		uint32_t offset;
+		if (ix < cc->count) {
+			offset = c->slots[hc->slab_offset + ix] * (uint32_t)hc->max_size;
+			cc->ix = ix + 1;
+		} else {
+			offset = ebi_heap_alloc_slow(c, cls);
+		}
+
+		return cc->slab->data + offset;
+	} else {
+		return ebi_heap_alloc_big(c, size);
+	}
+}
+
+// Free a pointer returned by `ebi_heap_alloc()`, can be called from any thread.
+static ebi_forceinline void
+ebi_heap_free(ebi_heap *heap, void *ptr)
+{
+	ebi_slab *slab = ebi_heap_get_slab(ptr);
+	if (slab->cls != EBI_SLAB_SPAN) {
+		uint32_t slot = ebi_slab_get_slot(slab, ptr);
+		slab->gen_g[slot] = 0;
+		slab->gen_n[slot] = 0;
+		if (slab->pin_mask[slot / 32] & (1u << (slot % 32))) {
+			ebi_atomic_and32(&slab->pin_mask[slot / 32], ~(1u << (slot % 32)));
 		}
 
-		return slab->data + offset;
+		// Sequentially consistent so that either we see the slab detached
+		// or the owner sees the bit, pairs with `ebi_heap_detach_slab()`.
+		// Also releases the slot so it isn't reused before we're done.
+		ebi_atomic_or32(&slab->mask[slot / 32], 1u << (slot % 32));
+		if (ebi_atomic_load32(&slab->state) == EBI_SLAB_DETACHED) {
+			ebi_heap_slab_freed(heap, slab);
+		}
 	} else {
-		void *ptr = ebi_heap_alloc_big(c, size);
-		*header_offset = 0;
-		return ptr;
+		ebi_heap_free_big(heap, slab);
 	}
 }
 
@@ -3,39 +3,491 @@
 
 #include "ebi_platform.h"
 
+// Atomics, bit manipulation and prefetching
+//
+// Atomic operations come in variants with explicit memory ordering. The
+// unsuffixed versions are sequentially consistent, `_acquire`, `_release` and
+// `_relaxed` map to the corresponding C11 orderings. Use the weakest one that
+// is correct and document what it pairs with.
+//
+// `ebi_atomic_dcas()` is a double-width (2x pointer) compare-and-swap that
+// writes the current value to `cmp` on failure. `dst` must be aligned to
+// the size of the double-width value.
+
 #if EBI_CC_MSC
 
 #include <intrin0.h>
 
-static ebi_forceinline uint32_t ebi_atomic_or32(uint32_t *dst, uint32_t value) {
-	return (uint32_t)_InterlockedOr((volatile long*)dst, (long)value);
+#if defined(_M_X64) || defined(_M_IX86)
+	#include <xmmintrin.h>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86)
+	#define ebi_msc_load_barrier() _ReadWriteBarrier()
+	#define ebi_msc_store_barrier() _ReadWriteBarrier()
+#else
+	#define ebi_msc_load_barrier() __dmb(_ARM64_BARRIER_ISH)
+	#define ebi_msc_store_barrier() __dmb(_ARM64_BARRIER_ISH)
+#endif
+
+static ebi_forceinline void ebi_pause() {
+#if defined(_M_X64) || defined(_M_IX86)
+	_mm_pause();
+#elif defined(_M_ARM64) || defined(_M_ARM)
+	__yield();
+#endif
+}
+
+static ebi_forceinline void ebi_prefetch(const void *ptr) {
+#if defined(_M_X64) || defined(_M_IX86)
+	_mm_prefetch((const char*)ptr, _MM_HINT_T0);
+#else
+	(void)ptr;
+#endif
+}
+
+static ebi_forceinline void ebi_atomic_fence_acquire() { ebi_msc_load_barrier(); }
+static ebi_forceinline void ebi_atomic_fence_release() { ebi_msc_store_barrier(); }
+static ebi_forceinline void ebi_atomic_fence_seq_cst() {
+#if defined(_M_X64) || defined(_M_IX86)
+	__faststorefence();
+#else
+	__dmb(_ARM64_BARRIER_ISH);
+#endif
+}
+
+static ebi_forceinline uint32_t ebi_atomic_load32(const uint32_t *src) {
+	return (uint32_t)_InterlockedOr((volatile long*)src, 0);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_load32_relaxed(const uint32_t *src) {
+	return *(volatile const uint32_t*)src;
+}
+
+static ebi_forceinline uint32_t ebi_atomic_load32_acquire(const uint32_t *src) {
+	uint32_t value = *(volatile const uint32_t*)src;
+	ebi_msc_load_barrier();
+	return value;
+}
+
+static ebi_forceinline uint64_t ebi_atomic_load64_relaxed(const uint64_t *src) {
+	return *(volatile const uint64_t*)src;
+}
+
+static ebi_forceinline uint64_t ebi_atomic_load64_acquire(const uint64_t *src) {
+	uint64_t value = *(volatile const uint64_t*)src;
+	ebi_msc_load_barrier();
+	return value;
+}
+
+static ebi_forceinline void ebi_atomic_store32(uint32_t *dst, uint32_t value) {
+	_InterlockedExchange((volatile long*)dst, (long)value);
+}
+
+static ebi_forceinline void ebi_atomic_store32_relaxed(uint32_t *dst, uint32_t value) {
+	*(volatile uint32_t*)dst = value;
+}
+
+static ebi_forceinline void ebi_atomic_store32_release(uint32_t *dst, uint32_t value) {
+	ebi_msc_store_barrier();
+	*(volatile uint32_t*)dst = value;
+}
+
+static ebi_forceinline void ebi_atomic_store64_relaxed(uint64_t *dst, uint64_t value) {
+	*(volatile uint64_t*)dst = value;
+}
+
+static ebi_forceinline void ebi_atomic_store64_release(uint64_t *dst, uint64_t value) {
+	ebi_msc_store_barrier();
+	*(volatile uint64_t*)dst = value;
+}
+
+static ebi_forceinline uint32_t ebi_atomic_cas32(uint32_t *dst, uint32_t cmp, uint32_t value) {
+	return (uint32_t)_InterlockedCompareExchange((volatile long*)dst, (long)value, (long)cmp);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_cas32_acquire(uint32_t *dst, uint32_t cmp, uint32_t value) {
+	return ebi_atomic_cas32(dst, cmp, value);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_cas32_release(uint32_t *dst, uint32_t cmp, uint32_t value) {
+	return ebi_atomic_cas32(dst, cmp, value);
+}
+
+static ebi_forceinline uint64_t ebi_atomic_cas64(uint64_t *dst, uint64_t cmp, uint64_t value) {
+	return (uint64_t)_InterlockedCompareExchange64((volatile long long*)dst, (long long)value, (long long)cmp);
 }
 
 static ebi_forceinline uint32_t ebi_atomic_xhg32(uint32_t *dst, uint32_t value) {
 	return (uint32_t)_InterlockedExchange((volatile long*)dst, (long)value);
 }
 
-static ebi_forceinline uint32_t ebi_bsf32(uint32_t value) {
-	unsigned long index;
-	_BitScanForward(&index, (unsigned long)value);
-	return (uint32_t)index;
+static ebi_forceinline uint32_t ebi_atomic_xhg32_acquire(uint32_t *dst, uint32_t value) {
+	return ebi_atomic_xhg32(dst, value);
 }
 
-static ebi_forceinline uint32_t ebi_atomic_dcas(uintptr_t *dst, uintptr_t *cmp, uintptr_t lo, uintptr_t hi)
+static ebi_forceinline uint32_t ebi_atomic_xhg32_release(uint32_t *dst, uint32_t value) {
+	return ebi_atomic_xhg32(dst, value);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_or32(uint32_t *dst, uint32_t value) {
+	return (uint32_t)_InterlockedOr((volatile long*)dst, (long)value);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_or32_release(uint32_t *dst, uint32_t value) {
+	return ebi_atomic_or32(dst, value);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_and32(uint32_t *dst, uint32_t value) {
+	return (uint32_t)_InterlockedAnd((volatile long*)dst, (long)value);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_add32(uint32_t *dst, uint32_t value) {
+	return (uint32_t)_InterlockedExchangeAdd((volatile long*)dst, (long)value);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_add32_relaxed(uint32_t *dst, uint32_t value) {
+	return ebi_atomic_add32(dst, value);
+}
+
+static ebi_forceinline uint64_t ebi_atomic_add64(uint64_t *dst, uint64_t value) {
+	return (uint64_t)_InterlockedExchangeAdd64((volatile long long*)dst, (long long)value);
+}
+
+static ebi_forceinline uint64_t ebi_atomic_add64_relaxed(uint64_t *dst, uint64_t value) {
+	return ebi_atomic_add64(dst, value);
+}
+
+static ebi_forceinline bool ebi_atomic_dcas(uintptr_t *dst, uintptr_t *cmp, uintptr_t lo, uintptr_t hi)
 {
-#if defined(_M_X64)
+#if defined(_M_X64) || defined(_M_ARM64)
 	return (bool)_InterlockedCompareExchange128((volatile long long*)dst,
 		(long long)hi, (long long) lo, (long long*)cmp);
 #else
 	long long r = (long long)cmp[1] << 32 | (long long)cmp[0];
 	long long v = _InterlockedCompareExchange64((volatile long long*)dst,
 		(long long)hi << 32 | (long long)lo, r);
-	cmp[0] = (uintptr_t)r;
-	cmp[1] = (uintptr_t)(r >> 32);
+	cmp[0] = (uintptr_t)v;
+	cmp[1] = (uintptr_t)(v >> 32);
 	return r == v;
 #endif
 }
 
+static ebi_forceinline bool ebi_atomic_dcas_acquire(uintptr_t *dst, uintptr_t *cmp, uintptr_t lo, uintptr_t hi) {
+	return ebi_atomic_dcas(dst, cmp, lo, hi);
+}
+
+static ebi_forceinline bool ebi_atomic_dcas_release(uintptr_t *dst, uintptr_t *cmp, uintptr_t lo, uintptr_t hi) {
+	return ebi_atomic_dcas(dst, cmp, lo, hi);
+}
+
+static ebi_forceinline uint32_t ebi_bsf32(uint32_t value) {
+	unsigned long index;
+	_BitScanForward(&index, (unsigned long)value);
+	return (uint32_t)index;
+}
+
+static ebi_forceinline uint32_t ebi_bsf64(uint64_t value) {
+	unsigned long index;
+#if defined(_M_IX86)
+	if (_BitScanForward(&index, (unsigned long)value)) return (uint32_t)index;
+	_BitScanForward(&index, (unsigned long)(value >> 32));
+	return (uint32_t)index + 32;
+#else
+	_BitScanForward64(&index, (unsigned __int64)value);
+	return (uint32_t)index;
+#endif
+}
+
+static ebi_forceinline uint32_t ebi_popcount32(uint32_t value) {
+	value = value - ((value >> 1) & 0x55555555u);
+	value = (value & 0x33333333u) + ((value >> 2) & 0x33333333u);
+	return (((value + (value >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24;
+}
+
+static ebi_forceinline uint32_t ebi_popcount64(uint64_t value) {
+	return ebi_popcount32((uint32_t)value) + ebi_popcount32((uint32_t)(value >> 32));
+}
+
+#elif EBI_CC_GNU
+
+#if defined(__aarch64__) && !defined(__ARM_FEATURE_ATOMICS) && EBI_OS_LINUX
+	#include <sys/auxv.h>
+	#include <asm/hwcap.h>
+#endif
+
+static ebi_forceinline void ebi_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static ebi_forceinline void ebi_prefetch(const void *ptr) {
+	__builtin_prefetch(ptr);
+}
+
+static ebi_forceinline void ebi_atomic_fence_acquire() { __atomic_thread_fence(__ATOMIC_ACQUIRE); }
+static ebi_forceinline void ebi_atomic_fence_release() { __atomic_thread_fence(__ATOMIC_RELEASE); }
+static ebi_forceinline void ebi_atomic_fence_seq_cst() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+static ebi_forceinline uint32_t ebi_atomic_load32(const uint32_t *src) {
+	return __atomic_load_n(src, __ATOMIC_SEQ_CST);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_load32_relaxed(const uint32_t *src) {
+	return __atomic_load_n(src, __ATOMIC_RELAXED);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_load32_acquire(const uint32_t *src) {
+	return __atomic_load_n(src, __ATOMIC_ACQUIRE);
+}
+
+static ebi_forceinline uint64_t ebi_atomic_load64_relaxed(const uint64_t *src) {
+	return __atomic_load_n(src, __ATOMIC_RELAXED);
+}
+
+static ebi_forceinline uint64_t ebi_atomic_load64_acquire(const uint64_t *src) {
+	return __atomic_load_n(src, __ATOMIC_ACQUIRE);
+}
+
+static ebi_forceinline void ebi_atomic_store32(uint32_t *dst, uint32_t value) {
+	__atomic_store_n(dst, value, __ATOMIC_SEQ_CST);
+}
+
+static ebi_forceinline void ebi_atomic_store32_relaxed(uint32_t *dst, uint32_t value) {
+	__atomic_store_n(dst, value, __ATOMIC_RELAXED);
+}
+
+static ebi_forceinline void ebi_atomic_store32_release(uint32_t *dst, uint32_t value) {
+	__atomic_store_n(dst, value, __ATOMIC_RELEASE);
+}
+
+static ebi_forceinline void ebi_atomic_store64_relaxed(uint64_t *dst, uint64_t value) {
+	__atomic_store_n(dst, value, __ATOMIC_RELAXED);
+}
+
+static ebi_forceinline void ebi_atomic_store64_release(uint64_t *dst, uint64_t value) {
+	__atomic_store_n(dst, value, __ATOMIC_RELEASE);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_cas32(uint32_t *dst, uint32_t cmp, uint32_t value) {
+	__atomic_compare_exchange_n(dst, &cmp, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return cmp;
+}
+
+static ebi_forceinline uint32_t ebi_atomic_cas32_acquire(uint32_t *dst, uint32_t cmp, uint32_t value) {
+	__atomic_compare_exchange_n(dst, &cmp, value, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE);
+	return cmp;
+}
+
+static ebi_forceinline uint32_t ebi_atomic_cas32_release(uint32_t *dst, uint32_t cmp, uint32_t value) {
+	__atomic_compare_exchange_n(dst, &cmp, value, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	return cmp;
+}
+
+static ebi_forceinline uint64_t ebi_atomic_cas64(uint64_t *dst, uint64_t cmp, uint64_t value) {
+	__atomic_compare_exchange_n(dst, &cmp, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return cmp;
+}
+
+static ebi_forceinline uint32_t ebi_atomic_xhg32(uint32_t *dst, uint32_t value) {
+	return __atomic_exchange_n(dst, value, __ATOMIC_SEQ_CST);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_xhg32_acquire(uint32_t *dst, uint32_t value) {
+	return __atomic_exchange_n(dst, value, __ATOMIC_ACQUIRE);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_xhg32_release(uint32_t *dst, uint32_t value) {
+	return __atomic_exchange_n(dst, value, __ATOMIC_RELEASE);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_or32(uint32_t *dst, uint32_t value) {
+	return __atomic_fetch_or(dst, value, __ATOMIC_SEQ_CST);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_or32_release(uint32_t *dst, uint32_t value) {
+	return __atomic_fetch_or(dst, value, __ATOMIC_RELEASE);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_and32(uint32_t *dst, uint32_t value) {
+	return __atomic_fetch_and(dst, value, __ATOMIC_SEQ_CST);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_add32(uint32_t *dst, uint32_t value) {
+	return __atomic_fetch_add(dst, value, __ATOMIC_SEQ_CST);
+}
+
+static ebi_forceinline uint32_t ebi_atomic_add32_relaxed(uint32_t *dst, uint32_t value) {
+	return __atomic_fetch_add(dst, value, __ATOMIC_RELAXED);
+}
+
+static ebi_forceinline uint64_t ebi_atomic_add64(uint64_t *dst, uint64_t value) {
+	return __atomic_fetch_add(dst, value, __ATOMIC_SEQ_CST);
+}
+
+static ebi_forceinline uint64_t ebi_atomic_add64_relaxed(uint64_t *dst, uint64_t value) {
+	return __atomic_fetch_add(dst, value, __ATOMIC_RELAXED);
+}
+
+#if defined(__x86_64__)
+
+// `cmpxchg16b` is missing only from the very first AMD64 CPUs, all x86-64
+// versions of Windows since 8.1 require it so assume it's available. The
+// instruction is always a full barrier so all orderings use it as-is.
+// Use inline assembly as `__atomic` on 16-byte types would go through libatomic
+// unless compiling with `-mcx16`.
+
+static ebi_forceinline bool ebi_atomic_dcas(uintptr_t *dst, uintptr_t *cmp, uintptr_t lo, uintptr_t hi)
+{
+	bool ok;
+	__asm__ __volatile__("lock cmpxchg16b %1"
+		: "=@ccz"(ok), "+m"(*(volatile __int128*)dst), "+a"(cmp[0]), "+d"(cmp[1])
+		: "b"(lo), "c"(hi)
+		: "memory");
+	return ok;
+}
+
+static ebi_forceinline bool ebi_atomic_dcas_acquire(uintptr_t *dst, uintptr_t *cmp, uintptr_t lo, uintptr_t hi) {
+	return ebi_atomic_dcas(dst, cmp, lo, hi);
+}
+
+static ebi_forceinline bool ebi_atomic_dcas_release(uintptr_t *dst, uintptr_t *cmp, uintptr_t lo, uintptr_t hi) {
+	return ebi_atomic_dcas(dst, cmp, lo, hi);
+}
+
+#elif defined(__aarch64__)
+
+// ARMv8.1 LSE has `casp` which is a single instruction DCAS. Base ARMv8.0 only
+// has exclusive pairs which need a retry loop. If the compiler is not allowed
+// to assume LSE we detect it at runtime and branch to the best version.
+
+#define EBI_AARCH64_CASP(name, casp) \
+	static ebi_forceinline bool name(uintptr_t *dst, uintptr_t *cmp, uintptr_t lo, uintptr_t hi) { \
+		register uint64_t x0 __asm__("x0") = cmp[0], x1 __asm__("x1") = cmp[1]; \
+		register uint64_t x2 __asm__("x2") = lo, x3 __asm__("x3") = hi; \
+		const uint64_t c0 = cmp[0], c1 = cmp[1]; \
+		__asm__ __volatile__(".arch_extension lse\n\t" casp " x0, x1, x2, x3, %2" \
+			: "+r"(x0), "+r"(x1), "+Q"(*(volatile __int128*)dst) \
+			: "r"(x2), "r"(x3) \
+			: "memory"); \
+		cmp[0] = x0; cmp[1] = x1; \
+		return x0 == c0 && x1 == c1; \
+	}
+
+// On a mismatch we still need to store the old value back: the loaded pair is
+// only guaranteed to be single-copy atomic if the store-exclusive succeeds.
+#define EBI_AARCH64_LLSC(name, ldxp, stxp) \
+	static ebi_forceinline bool name(uintptr_t *dst, uintptr_t *cmp, uintptr_t lo, uintptr_t hi) { \
+		uint64_t old_lo, old_hi, tmp_lo, tmp_hi; uint32_t fail; \
+		__asm__ __volatile__( \
+			"1:\t" ldxp " %[olo], %[ohi], %[ptr]\n\t" \
+			"cmp %[olo], %[clo]\n\t" \
+			"ccmp %[ohi], %[chi], #0, eq\n\t" \
+			"csel %[tlo], %[nlo], %[olo], eq\n\t" \
+			"csel %[thi], %[nhi], %[ohi], eq\n\t" \
+			stxp " %w[fail], %[tlo], %[thi], %[ptr]\n\t" \
+			"cbnz %w[fail], 1b" \
+			: [olo] "=&r"(old_lo), [ohi] "=&r"(old_hi), [tlo] "=&r"(tmp_lo), [thi] "=&r"(tmp_hi), \
+			  [fail] "=&r"(fail), [ptr] "+Q"(*(volatile __int128*)dst) \
+			: [clo] "r"((uint64_t)cmp[0]), [chi] "r"((uint64_t)cmp[1]), [nlo] "r"((uint64_t)lo), [nhi] "r"((uint64_t)hi) \
+			: "cc", "memory"); \
+		bool ok = old_lo == cmp[0] && old_hi == cmp[1]; \
+		cmp[0] = old_lo; cmp[1] = old_hi; \
+		return ok; \
+	}
+
+EBI_AARCH64_CASP(ebi_atomic_dcas_lse, "caspal")
+EBI_AARCH64_CASP(ebi_atomic_dcas_acquire_lse, "caspa")
+EBI_AARCH64_CASP(ebi_atomic_dcas_release_lse, "caspl")
+
+#if defined(__ARM_FEATURE_ATOMICS)
+
+static ebi_forceinline bool ebi_cpu_has_lse() { return true; }
+
+#else
+
+EBI_AARCH64_LLSC(ebi_atomic_dcas_llsc, "ldaxp", "stlxp")
+EBI_AARCH64_LLSC(ebi_atomic_dcas_acquire_llsc, "ldaxp", "stxp")
+EBI_AARCH64_LLSC(ebi_atomic_dcas_release_llsc, "ldxp", "stlxp")
+
+static ebi_noinline bool ebi_cpu_detect_lse(int *state) {
+#if EBI_OS_LINUX
+	bool lse = (getauxval(AT_HWCAP) & HWCAP_ATOMICS) != 0;
+#else
+	bool lse = false;
+#endif
+	__atomic_store_n(state, lse ? 2 : 1, __ATOMIC_RELAXED);
+	return lse;
+}
+
+static ebi_forceinline bool ebi_cpu_has_lse() {
+	static int state = 0; // 0: unknown, 1: no LSE, 2: has LSE
+	int s = __atomic_load_n(&state, __ATOMIC_RELAXED);
+	if (s == 0) return ebi_cpu_detect_lse(&state);
+	return s == 2;
+}
+
+#endif
+
+static ebi_forceinline bool ebi_atomic_dcas(uintptr_t *dst, uintptr_t *cmp, uintptr_t lo, uintptr_t hi) {
+#if !defined(__ARM_FEATURE_ATOMICS)
+	if (!ebi_cpu_has_lse()) return ebi_atomic_dcas_llsc(dst, cmp, lo, hi);
+#endif
+	return ebi_atomic_dcas_lse(dst, cmp, lo, hi);
+}
+
+static ebi_forceinline bool ebi_atomic_dcas_acquire(uintptr_t *dst, uintptr_t *cmp, uintptr_t lo, uintptr_t hi) {
+#if !defined(__ARM_FEATURE_ATOMICS)
+	if (!ebi_cpu_has_lse()) return ebi_atomic_dcas_acquire_llsc(dst, cmp, lo, hi);
+#endif
+	return ebi_atomic_dcas_acquire_lse(dst, cmp, lo, hi);
+}
+
+static ebi_forceinline bool ebi_atomic_dcas_release(uintptr_t *dst, uintptr_t *cmp, uintptr_t lo, uintptr_t hi) {
+#if !defined(__ARM_FEATURE_ATOMICS)
+	if (!ebi_cpu_has_lse()) return ebi_atomic_dcas_release_llsc(dst, cmp, lo, hi);
+#endif
+	return ebi_atomic_dcas_release_lse(dst, cmp, lo, hi);
+}
+
+#else
+
+// 32-bit targets: pack both halves into a native 64-bit CAS
+
+#define EBI_GNU_DCAS64(name, order, fail_order) \
+	static ebi_forceinline bool name(uintptr_t *dst, uintptr_t *cmp, uintptr_t lo, uintptr_t hi) { \
+		uint64_t c = (uint64_t)cmp[1] << 32 | (uint64_t)cmp[0]; \
+		bool ok = __atomic_compare_exchange_n((uint64_t*)dst, &c, (uint64_t)hi << 32 | (uint64_t)lo, \
+			false, order, fail_order); \
+		cmp[0] = (uintptr_t)c; cmp[1] = (uintptr_t)(c >> 32); \
+		return ok; \
+	}
+
+EBI_GNU_DCAS64(ebi_atomic_dcas, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+EBI_GNU_DCAS64(ebi_atomic_dcas_acquire, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)
+EBI_GNU_DCAS64(ebi_atomic_dcas_release, __ATOMIC_RELEASE, __ATOMIC_RELAXED)
+
+#endif
+
+static ebi_forceinline uint32_t ebi_bsf32(uint32_t value) {
+	return (uint32_t)__builtin_ctz(value);
+}
+
+static ebi_forceinline uint32_t ebi_bsf64(uint64_t value) {
+	return (uint32_t)__builtin_ctzll(value);
+}
+
+static ebi_forceinline uint32_t ebi_popcount32(uint32_t value) {
+	return (uint32_t)__builtin_popcount(value);
+}
+
+static ebi_forceinline uint32_t ebi_popcount64(uint64_t value) {
+	return (uint32_t)__builtin_popcountll(value);
+}
+
 #endif
 
 #endif
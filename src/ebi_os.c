@@ -0,0 +1,198 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+	#define _GNU_SOURCE // MAP_ANONYMOUS, MAP_NORESERVE
+#endif
+
+#include "ebi_os.h"
+
+#include <stdlib.h>
+
+#if EBI_OS_WIN32
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+size_t ebi_os_page_size()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+}
+
+void *ebi_os_reserve(size_t size)
+{
+	return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+bool ebi_os_commit(void *ptr, size_t size)
+{
+	return VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+}
+
+void ebi_os_decommit(void *ptr, size_t size)
+{
+	VirtualFree(ptr, size, MEM_DECOMMIT);
+}
+
+void ebi_os_release(void *ptr, size_t size)
+{
+	VirtualFree(ptr, 0, MEM_RELEASE);
+}
+
+// Windows can't release part of a reservation, so reserve extra, release it
+// and try to reserve the aligned part before someone else gets there.
+void *ebi_os_reserve_aligned(size_t size, size_t align)
+{
+	for (uint32_t attempt = 0; attempt < 8; attempt++) {
+		char *base = (char*)VirtualAlloc(NULL, size + align, MEM_RESERVE, PAGE_NOACCESS);
+		if (!base) return NULL;
+		char *ptr = (char*)(((uintptr_t)base + align - 1) & ~(uintptr_t)(align - 1));
+		VirtualFree(base, 0, MEM_RELEASE);
+		if (VirtualAlloc(ptr, size, MEM_RESERVE, PAGE_NOACCESS)) return ptr;
+	}
+	return NULL;
+}
+
+// Large pages need a privilege and can't be committed lazily
+bool ebi_os_advise_huge_pages(void *ptr, size_t size)
+{
+	return false;
+}
+
+typedef struct {
+	ebi_os_thread_fn *fn;
+	void *user;
+} ebi_os_thread_start;
+
+static DWORD WINAPI ebi_os_thread_entry(LPVOID arg)
+{
+	ebi_os_thread_start start = *(ebi_os_thread_start*)arg;
+	free(arg);
+	start.fn(start.user);
+	return 0;
+}
+
+bool ebi_os_start_thread(ebi_os_thread_fn *fn, void *user)
+{
+	ebi_os_thread_start *start = (ebi_os_thread_start*)malloc(sizeof(ebi_os_thread_start));
+	if (!start) return false;
+	start->fn = fn;
+	start->user = user;
+	HANDLE thread = CreateThread(NULL, 0, &ebi_os_thread_entry, start, 0, NULL);
+	if (!thread) {
+		free(start);
+		return false;
+	}
+	CloseHandle(thread);
+	return true;
+}
+
+void ebi_os_sleep_ms(uint32_t ms)
+{
+	Sleep(ms);
+}
+
+#elif EBI_OS_LINUX
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+size_t ebi_os_page_size()
+{
+	return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Linux commits pages lazily on first touch so reserving maps the memory as
+// accessible right away. `MAP_NORESERVE` avoids charging the whole
+// reservation against the overcommit limit.
+
+void *ebi_os_reserve(size_t size)
+{
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return ptr != MAP_FAILED ? ptr : NULL;
+}
+
+bool ebi_os_commit(void *ptr, size_t size)
+{
+	(void)ptr;
+	(void)size;
+	return true;
+}
+
+// `MADV_FREE` would be cheaper but the pages stay in RSS until there is
+// memory pressure, `MADV_DONTNEED` drops them right away. The range reads
+// back as zeroes afterwards.
+void ebi_os_decommit(void *ptr, size_t size)
+{
+	madvise(ptr, size, MADV_DONTNEED);
+}
+
+void ebi_os_release(void *ptr, size_t size)
+{
+	munmap(ptr, size);
+}
+
+void *ebi_os_reserve_aligned(size_t size, size_t align)
+{
+	char *base = (char*)ebi_os_reserve(size + align);
+	if (!base) return NULL;
+
+	// Trim the unaligned head and the leftover tail
+	char *ptr = (char*)(((uintptr_t)base + align - 1) & ~(uintptr_t)(align - 1));
+	size_t head = (size_t)(ptr - base), tail = align - head;
+	if (head > 0) munmap(base, head);
+	if (tail > 0) munmap(ptr + size, tail);
+	return ptr;
+}
+
+// Transparent huge pages are used only if the kernel allows it, `madvise`
+// fails if THP is disabled or not compiled in.
+bool ebi_os_advise_huge_pages(void *ptr, size_t size)
+{
+#if defined(MADV_HUGEPAGE)
+	return madvise(ptr, size, MADV_HUGEPAGE) == 0;
+#else
+	return false;
+#endif
+}
+
+typedef struct {
+	ebi_os_thread_fn *fn;
+	void *user;
+} ebi_os_thread_start;
+
+static void *ebi_os_thread_entry(void *arg)
+{
+	ebi_os_thread_start start = *(ebi_os_thread_start*)arg;
+	free(arg);
+	start.fn(start.user);
+	return NULL;
+}
+
+bool ebi_os_start_thread(ebi_os_thread_fn *fn, void *user)
+{
+	ebi_os_thread_start *start = (ebi_os_thread_start*)malloc(sizeof(ebi_os_thread_start));
+	if (!start) return false;
+	start->fn = fn;
+	start->user = user;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, &ebi_os_thread_entry, start) != 0) {
+		free(start);
+		return false;
+	}
+	pthread_detach(thread);
+	return true;
+}
+
+void ebi_os_sleep_ms(uint32_t ms)
+{
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+}
+
+#else
+	#error "Unsupported OS"
+#endif
@@ -0,0 +1,27 @@
+#ifndef EBI_OS_H
+#define EBI_OS_H
+
+#include "ebi_platform.h"
+
+// Virtual memory: Address space is reserved in large chunks up front and
+// committed in smaller pieces as it's needed.
+
+size_t ebi_os_page_size();
+
+void *ebi_os_reserve(size_t size);
+void *ebi_os_reserve_aligned(size_t size, size_t align);
+bool ebi_os_commit(void *ptr, size_t size);
+void ebi_os_decommit(void *ptr, size_t size);
+void ebi_os_release(void *ptr, size_t size);
+
+// Ask for `ptr` to be backed by huge pages, returns `false` if not supported.
+bool ebi_os_advise_huge_pages(void *ptr, size_t size);
+
+// Threads: Started detached, they run until `fn` returns.
+
+typedef void ebi_os_thread_fn(void *user);
+
+bool ebi_os_start_thread(ebi_os_thread_fn *fn, void *user);
+void ebi_os_sleep_ms(uint32_t ms);
+
+#endif
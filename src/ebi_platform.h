@@ -2,6 +2,8 @@
 #define EBI_PLATFORM_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 // Compiler and OS abstraction
 
@@ -13,6 +15,9 @@
 #define EBI_CC_GNU 0   // GNU extensions (GCC / Clang)
 
 #define EBI_OS_WIN32 0  // Windows
+#define EBI_OS_LINUX 0  // Linux
+
+#define EBI_CPU_X86 0   // x86 or x86-64
 
 #if defined(_MSC_VER)
 	#undef EBI_CC_MSC
@@ -33,6 +38,14 @@
 #if defined(_WIN32)
 	#undef EBI_OS_WIN32
 	#define EBI_OS_WIN32 1
+#elif defined(__linux__)
+	#undef EBI_OS_LINUX
+	#define EBI_OS_LINUX 1
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#undef EBI_CPU_X86
+	#define EBI_CPU_X86 1
 #endif
 
 #ifndef EBI_DEBUG
@@ -56,6 +69,21 @@
 	#define ebi_noinline
 #endif
 
+#if EBI_CC_MSC
+	#define ebi_aligned(n) __declspec(align(n))
+#elif EBI_CC_GNU
+	#define ebi_aligned(n) __attribute__((aligned(n)))
+#else
+	#define ebi_aligned(n)
+#endif
+
+// Allow using instructions of `features` in a function, MSVC allows it anywhere
+#if EBI_CC_GNU
+	#define ebi_target(features) __attribute__((target(features)))
+#else
+	#define ebi_target(features)
+#endif
+
 #if EBI_CC_MSC
 	#define EBI_FLEXIBLE_ARRAY 0
 #elif EBI_CC_GNU
@@ -0,0 +1,363 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+	#define _GNU_SOURCE // syscall()
+#endif
+
+#include "ebi_sync.h"
+#include "ebi_intrin.h"
+
+// -- OS wait primitives
+
+#if EBI_OS_WIN32
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#pragma comment(lib, "Synchronization.lib")
+
+static void ebi_os_wait(uint32_t *addr, uint32_t value)
+{
+	WaitOnAddress(addr, &value, sizeof(uint32_t), INFINITE);
+}
+
+static void ebi_os_wake_one(uint32_t *addr)
+{
+	WakeByAddressSingle(addr);
+}
+
+static void ebi_os_wake_all(uint32_t *addr)
+{
+	WakeByAddressAll(addr);
+}
+
+static void ebi_os_yield()
+{
+	SwitchToThread();
+}
+
+#elif EBI_OS_LINUX
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <sched.h>
+#include <limits.h>
+
+// Process private futexes skip the shared mapping lookup in the kernel
+
+static void ebi_os_wait(uint32_t *addr, uint32_t value)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void ebi_os_wake_one(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void ebi_os_wake_all(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void ebi_os_yield()
+{
+	sched_yield();
+}
+
+#else
+	#error "Unsupported OS"
+#endif
+
+// -- Intrusive atomic stack
+
+// Pushes use release ordering to publish the contents of the node (including
+// `next`) and pops acquire to see them. The snapshot loaded before the CAS
+// loop may be torn but the DCAS validates it.
+
+static ebi_forceinline ebi_ia_stack ebi_ia_snapshot(ebi_ia_stack *s)
+{
+	ebi_ia_stack r;
+	r.v[0] = *(volatile uintptr_t*)&s->v[0];
+	r.v[1] = *(volatile uintptr_t*)&s->v[1];
+	return r;
+}
+
+void ebi_ia_push(ebi_ia_stack *s, void *ptr)
+{
+	ebi_ia_stack r = ebi_ia_snapshot(s);
+	do {
+		*(void**)ptr = (void*)r.v[0];
+	} while (!ebi_atomic_dcas_release(s->v, r.v, (uintptr_t)ptr, r.v[1] + 1));
+}
+
+// Push a linked list of nodes to an empty stack.
+void ebi_ia_push_all(ebi_ia_stack *s, void *ptr)
+{
+	ebi_ia_stack r = ebi_ia_snapshot(s);
+	do {
+		ebi_assert(r.v[0] == 0);
+	} while (!ebi_atomic_dcas_release(s->v, r.v, (uintptr_t)ptr, r.v[1] + 1));
+}
+
+void *ebi_ia_pop(ebi_ia_stack *s)
+{
+	ebi_ia_stack r = ebi_ia_snapshot(s);
+	void **head;
+	do {
+		head = (void**)r.v[0];
+		if (!head) return NULL;
+	} while (!ebi_atomic_dcas_acquire(s->v, r.v, (uintptr_t)*(void* volatile*)head, r.v[1] + 1));
+	*head = NULL;
+	return head;
+}
+
+// Pop the whole stack as a linked list.
+void *ebi_ia_pop_all(ebi_ia_stack *s)
+{
+	ebi_ia_stack r = ebi_ia_snapshot(s);
+	void **head;
+	do {
+		head = (void**)r.v[0];
+	} while (!ebi_atomic_dcas_acquire(s->v, r.v, 0, r.v[1] + 1));
+	return head;
+}
+
+// Cheap racy check, use for skipping work only.
+bool ebi_ia_maybe_nonempty(ebi_ia_stack *s)
+{
+	return *(volatile uintptr_t*)&s->v[0] != 0;
+}
+
+// Number of modifications to the stack, can be used to detect changes.
+uintptr_t ebi_ia_get_count(ebi_ia_stack *s)
+{
+#if UINTPTR_MAX > UINT32_MAX
+	return (uintptr_t)ebi_atomic_load64_acquire((const uint64_t*)&s->v[1]);
+#else
+	return (uintptr_t)ebi_atomic_load32_acquire((const uint32_t*)&s->v[1]);
+#endif
+}
+
+// -- Work-stealing deque
+
+// Based on "Correct and Efficient Work-Stealing for Weak Memory Models"
+// (Le et al. 2013) without the growable buffer: if the deque is full the
+// caller is expected to spill the work somewhere else.
+
+// Push to the bottom, owner only. Returns `false` if the deque is full.
+bool ebi_ws_push(ebi_ws_deque *dq, void *ptr)
+{
+	uint32_t b = dq->bottom;
+	uint32_t t = ebi_atomic_load32_acquire(&dq->top);
+	if (b - t >= EBI_WS_DEQUE_SIZE) return false;
+
+	*(void* volatile*)&dq->slots[b % EBI_WS_DEQUE_SIZE] = ptr;
+
+	// Publish the slot to stealers
+	ebi_atomic_store32_release(&dq->bottom, b + 1);
+	ebi_atomic_store32_relaxed(&dq->pushes, dq->pushes + 1);
+	return true;
+}
+
+// Pop from the bottom, owner only.
+void *ebi_ws_pop(ebi_ws_deque *dq)
+{
+	uint32_t b = dq->bottom - 1;
+	ebi_atomic_store32_relaxed(&dq->bottom, b);
+
+	// Reserving the slot must be visible before we read `top`, otherwise
+	// we could race a stealer for it. Pairs with the fence in `ebi_ws_steal()`.
+	ebi_atomic_fence_seq_cst();
+
+	uint32_t t = ebi_atomic_load32_relaxed(&dq->top);
+	int32_t size = (int32_t)(b - t);
+	if (size < 0) {
+		ebi_atomic_store32_relaxed(&dq->bottom, b + 1);
+		return NULL;
+	}
+
+	void *ptr = dq->slots[b % EBI_WS_DEQUE_SIZE];
+	if (size == 0) {
+		// Last item, race stealers for it by advancing `top`
+		if (ebi_atomic_cas32(&dq->top, t, t + 1) != t) ptr = NULL;
+		ebi_atomic_store32_relaxed(&dq->bottom, b + 1);
+	}
+	return ptr;
+}
+
+// Steal from the top, any thread. Returns `NULL` if the deque is empty or
+// we lost a race to another thread.
+void *ebi_ws_steal(ebi_ws_deque *dq)
+{
+	uint32_t t = ebi_atomic_load32_acquire(&dq->top);
+	ebi_atomic_fence_seq_cst();
+	uint32_t b = ebi_atomic_load32_acquire(&dq->bottom);
+	if ((int32_t)(b - t) <= 0) return NULL;
+
+	// The owner can't overwrite the slot before `top` advances past it so
+	// if the CAS succeeds the value we read is valid.
+	void *ptr = *(void* volatile*)&dq->slots[t % EBI_WS_DEQUE_SIZE];
+	if (ebi_atomic_cas32(&dq->top, t, t + 1) != t) return NULL;
+	return ptr;
+}
+
+// Cheap racy check, use for skipping work only.
+bool ebi_ws_maybe_nonempty(ebi_ws_deque *dq)
+{
+	uint32_t t = *(volatile uint32_t*)&dq->top;
+	uint32_t b = *(volatile uint32_t*)&dq->bottom;
+	return (int32_t)(b - t) > 0;
+}
+
+uint32_t ebi_ws_get_pushes(ebi_ws_deque *dq)
+{
+	return ebi_atomic_load32_acquire(&dq->pushes);
+}
+
+// -- Adaptive spinning
+
+#define EBI_SPIN_DEFAULT 256   // Initial budget for a fresh zeroed lock
+#define EBI_SPIN_MIN 16        // Always spin at least a little
+#define EBI_SPIN_MAX 16384     // Upper bound, a few microseconds
+#define EBI_SPIN_MAX_DELAY 64  // Maximum pauses between polls
+#define EBI_SPIN_YIELD 4096    // Yield the core after spinning this long
+
+// Exponential backoff between polls so spinning threads don't hammer the
+// cache line. Once we've spun for a while give the core to another thread
+// in case the lock holder is waiting for it.
+static ebi_forceinline uint32_t ebi_spin_backoff(uint32_t spins, uint32_t *delay)
+{
+	uint32_t d = *delay;
+	if (spins >= EBI_SPIN_YIELD) {
+		ebi_os_yield();
+	} else {
+		for (uint32_t i = 0; i < d; i++) {
+			ebi_pause();
+		}
+	}
+	*delay = d < EBI_SPIN_MAX_DELAY ? d * 2 : d;
+	return spins + d;
+}
+
+static ebi_forceinline uint32_t ebi_spin_budget(const uint32_t *budget)
+{
+	// The budget is only a heuristic so racy accesses are fine
+	uint32_t b = *(volatile const uint32_t*)budget;
+	return b ? b : EBI_SPIN_DEFAULT;
+}
+
+// Update the spin budget as a moving average of `sample`: the number of
+// spins it took to acquire the lock, or the current budget halved if spinning
+// didn't help and we had to park the thread.
+static ebi_forceinline void ebi_spin_adapt(uint32_t *budget, uint32_t sample)
+{
+	uint32_t b = ebi_spin_budget(budget);
+	b = b - b / 8 + sample / 8;
+	if (b < EBI_SPIN_MIN) b = EBI_SPIN_MIN;
+	if (b > EBI_SPIN_MAX) b = EBI_SPIN_MAX;
+	*(volatile uint32_t*)budget = b;
+}
+
+// Spin until `*addr != value` or the budget runs out.
+// Returns the number of spins it took or `UINT32_MAX` if the wait timed out.
+static uint32_t ebi_spin_while(uint32_t *addr, uint32_t value, uint32_t budget)
+{
+	uint32_t spins = 0, delay = 1;
+	while (spins < budget) {
+		if (*(volatile uint32_t*)addr != value) return spins;
+		spins = ebi_spin_backoff(spins, &delay);
+	}
+	return UINT32_MAX;
+}
+
+// -- Mutex
+
+static ebi_noinline void ebi_mutex_lock_slow(ebi_mutex *m)
+{
+	uint32_t budget = ebi_spin_budget(&m->spin);
+
+	// Spin while the lock is held without sleepers. If there are threads
+	// already parked on it we'd only be stealing the lock from them.
+	uint32_t spins = 0, delay = 1;
+	while (spins < budget) {
+		uint32_t state = *(volatile uint32_t*)&m->state;
+		if (state == 0) {
+			if (ebi_atomic_cas32_acquire(&m->state, 0, 1) == 0) {
+				// Spinning paid off, allow up to twice as much next time
+				ebi_spin_adapt(&m->spin, spins * 2);
+				return;
+			}
+		} else if (state == 2) {
+			break;
+		}
+		spins = ebi_spin_backoff(spins, &delay);
+	}
+
+	ebi_spin_adapt(&m->spin, budget / 2);
+
+	// Park: Mark the lock as contended and sleep until woken up. We don't know
+	// if there are other waiters when we finally get the lock so we must
+	// conservatively acquire it as contended.
+	while (ebi_atomic_xhg32_acquire(&m->state, 2) != 0) {
+		ebi_os_wait(&m->state, 2);
+	}
+}
+
+void ebi_mutex_lock(ebi_mutex *m)
+{
+	if (ebi_atomic_cas32_acquire(&m->state, 0, 1) == 0) return;
+	ebi_mutex_lock_slow(m);
+}
+
+bool ebi_mutex_try_lock(ebi_mutex *m)
+{
+	return ebi_atomic_cas32_acquire(&m->state, 0, 1) == 0;
+}
+
+void ebi_mutex_unlock(ebi_mutex *m)
+{
+	if (ebi_atomic_xhg32_release(&m->state, 0) == 2) {
+		ebi_os_wake_one(&m->state);
+	}
+}
+
+// -- Fence
+
+// Safe to call from multiple threads: a closed fence is left as is so that
+// marking sleepers with 2 is never undone, otherwise `ebi_fence_open()`
+// would skip waking them up.
+void ebi_fence_close(ebi_fence *f)
+{
+	ebi_atomic_cas32(&f->state, 0, 1);
+}
+
+void ebi_fence_open(ebi_fence *f)
+{
+	if (ebi_atomic_xhg32_release(&f->state, 0) == 2) {
+		ebi_os_wake_all(&f->state);
+	}
+}
+
+void ebi_fence_wait(ebi_fence *f)
+{
+	uint32_t state = ebi_atomic_load32_acquire(&f->state);
+	if (state == 0) return;
+
+	uint32_t budget = ebi_spin_budget(&f->spin);
+	if (state == 1) {
+		uint32_t spins = ebi_spin_while(&f->state, 1, budget);
+		if (spins != UINT32_MAX && ebi_atomic_load32_acquire(&f->state) == 0) {
+			ebi_spin_adapt(&f->spin, spins * 2);
+			return;
+		}
+	}
+
+	ebi_spin_adapt(&f->spin, budget / 2);
+
+	// Mark that there are sleepers so `ebi_fence_open()` knows to wake us up
+	for (;;) {
+		state = ebi_atomic_cas32(&f->state, 1, 2);
+		if (state == 0) break;
+		ebi_os_wait(&f->state, 2);
+	}
+}
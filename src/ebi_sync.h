@@ -0,0 +1,69 @@
+#ifndef EBI_SYNC_H
+#define EBI_SYNC_H
+
+#include "ebi_platform.h"
+
+typedef struct ebi_ia_stack ebi_ia_stack;
+typedef struct ebi_mutex ebi_mutex;
+typedef struct ebi_fence ebi_fence;
+typedef struct ebi_ws_deque ebi_ws_deque;
+
+// Intrusive atomic stack: Lock-free stack of nodes that have a `next` pointer
+// as their first member. `v[0]` is the head and `v[1]` a counter incremented
+// on every modification to prevent ABA problems.
+struct ebi_aligned(16) ebi_ia_stack {
+	uintptr_t v[2];
+};
+
+// Mutex that spins for a while before parking the thread in the OS.
+// The spin budget adapts to how long the lock is usually held: if spinning
+// tends to succeed the budget grows, if threads end up parking anyway it
+// shrinks so we don't burn cores waiting for long critical sections.
+struct ebi_mutex {
+	uint32_t state; // 0: unlocked, 1: locked, 2: locked with sleeping waiters
+	uint32_t spin;  // Adaptive spin budget in `ebi_pause()` units, 0 for default
+};
+
+// Gate that threads can wait on until it's opened, eg. GC stop-the-world.
+struct ebi_fence {
+	uint32_t state; // 0: open, 1: closed, 2: closed with sleeping waiters
+	uint32_t spin;  // Adaptive spin budget, see `ebi_mutex`
+};
+
+#define EBI_WS_DEQUE_SIZE 256
+
+// Chase-Lev work-stealing deque with a fixed capacity: The owner thread pushes
+// and pops at `bottom` while other threads steal from `top`. The owner does
+// not need any atomic read-modify-write operations unless racing a stealer
+// for the last item. Counters wrap around and are compared as signed.
+struct ebi_ws_deque {
+	uint32_t top;
+	uint8_t pad0[60];
+	uint32_t bottom;
+	uint32_t pushes; // Total number of pushes, can be used to detect new work
+	uint8_t pad1[56];
+	void *slots[EBI_WS_DEQUE_SIZE];
+};
+
+void ebi_ia_push(ebi_ia_stack *s, void *ptr);
+void ebi_ia_push_all(ebi_ia_stack *s, void *ptr);
+void *ebi_ia_pop(ebi_ia_stack *s);
+void *ebi_ia_pop_all(ebi_ia_stack *s);
+bool ebi_ia_maybe_nonempty(ebi_ia_stack *s);
+uintptr_t ebi_ia_get_count(ebi_ia_stack *s);
+
+bool ebi_ws_push(ebi_ws_deque *dq, void *ptr);
+void *ebi_ws_pop(ebi_ws_deque *dq);
+void *ebi_ws_steal(ebi_ws_deque *dq);
+bool ebi_ws_maybe_nonempty(ebi_ws_deque *dq);
+uint32_t ebi_ws_get_pushes(ebi_ws_deque *dq);
+
+void ebi_mutex_lock(ebi_mutex *m);
+bool ebi_mutex_try_lock(ebi_mutex *m);
+void ebi_mutex_unlock(ebi_mutex *m);
+
+void ebi_fence_close(ebi_fence *f);
+void ebi_fence_open(ebi_fence *f);
+void ebi_fence_wait(ebi_fence *f);
+
+#endif